@@ -0,0 +1,375 @@
+/*
+ * libnss_sqlite3: name service switch module for the users and groups in
+ * the pam_sqlite3 database.
+ *
+ * Options come from /etc/pam_sqlite3.conf with its [nss] section applied,
+ * and lookups go through the same engine as the PAM module: the sql_get*
+ * templates are compiled once and prepared on the engine's cached
+ * connections.  Enumeration (getpwent, getgrent) steps one statement as
+ * the caller asks for entries, so listing a large table never holds more
+ * than a row in memory.
+ *
+ * Use it with "passwd: files sqlite3" and "group: files sqlite3" in
+ * /etc/nsswitch.conf.
+ *
+ * This file is part of pam_sqlite3, see pam_sqlite3.c for copyright and
+ * licensing information.
+ */
+
+#include "pam_sqlite3_int.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <nss.h>
+#include <pwd.h>
+#include <grp.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#define NSS_SERVICE		"nss"
+
+/* an open getpwent() or getgrent() listing */
+struct cursor {
+	pthread_mutex_t lock;
+	struct p3auth_conn *conn;
+	sqlite3_stmt *vm;
+	pid_t pid;
+	int pending;		/* the current row did not fit, return it again */
+	int eof;
+};
+
+static pthread_once_t ctx_once = PTHREAD_ONCE_INIT;
+static p3auth_ctx *ctx;
+
+static struct cursor pwent = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static struct cursor grent = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void
+ctx_init(void)
+{
+	p3auth_ctx *c;
+
+	if (!(c = p3auth_new()))
+		return;
+	p3auth_set_service(c, NSS_SERVICE);
+	p3auth_load_config(c, CONF);
+	if (p3auth_prepare(c) != 0) {
+		p3auth_free(c);
+		return;
+	}
+	nss_prepare(c);
+	ctx = c;
+}
+
+/* the engine context, NULL if the configuration is unusable */
+static p3auth_ctx *
+get_ctx(void)
+{
+	pthread_once(&ctx_once, ctx_init);
+	return ctx;
+}
+
+/* copy a column into the caller's buffer, NULL if it does not fit */
+static char *
+pack(sqlite3_stmt *vm, int col, char **buf, size_t *left)
+{
+	const char *s = (const char *)sqlite3_column_text(vm, col);
+	size_t len = s ? strlen(s) + 1 : 1;
+	char *dst = *buf;
+
+	if (len > *left)
+		return NULL;
+	memcpy(dst, s ? s : "", len);
+	*buf += len;
+	*left -= len;
+	return dst;
+}
+
+static enum nss_status
+fill_passwd(sqlite3_stmt *vm, struct passwd *pw, char *buf, size_t buflen,
+	int *errnop)
+{
+	if (sqlite3_column_count(vm) < 7 ||
+			!(pw->pw_name = pack(vm, 0, &buf, &buflen)) ||
+			!(pw->pw_passwd = pack(vm, 1, &buf, &buflen)) ||
+			!(pw->pw_gecos = pack(vm, 4, &buf, &buflen)) ||
+			!(pw->pw_dir = pack(vm, 5, &buf, &buflen)) ||
+			!(pw->pw_shell = pack(vm, 6, &buf, &buflen))) {
+		*errnop = sqlite3_column_count(vm) < 7 ? ENOENT : ERANGE;
+		return *errnop == ERANGE ? NSS_STATUS_TRYAGAIN : NSS_STATUS_UNAVAIL;
+	}
+	pw->pw_uid = (uid_t)sqlite3_column_int64(vm, 2);
+	pw->pw_gid = (gid_t)sqlite3_column_int64(vm, 3);
+	return NSS_STATUS_SUCCESS;
+}
+
+/*
+ * Fill in a group from a (name, passwd, gid) row.  Members come from
+ * sql_getgrmem, run for the group's name on the same connection; it is
+ * stepped twice, once to size the member array and once to copy them.
+ */
+static enum nss_status
+fill_group(struct p3auth_conn *c, sqlite3_stmt *vm, struct group *gr,
+	char *buf, size_t buflen, int *errnop)
+{
+	struct p3auth_query *q = &ctx->nss[NSS_GETGRMEM];
+	sqlite3_stmt *mem = NULL;
+	size_t n = 0, align;
+
+	if (sqlite3_column_count(vm) < 3) {
+		*errnop = ENOENT;
+		return NSS_STATUS_UNAVAIL;
+	}
+	if (!(gr->gr_name = pack(vm, 0, &buf, &buflen)) ||
+			!(gr->gr_passwd = pack(vm, 1, &buf, &buflen)))
+		goto erange;
+	gr->gr_gid = (gid_t)sqlite3_column_int64(vm, 2);
+
+	if (q->sql) {
+		if (conn_stmt(ctx, c, q, &c->nss[NSS_GETGRMEM], gr->gr_name, NULL,
+				NULL, &mem) != SQLITE_OK) {
+			stmt_done(mem, c->nss[NSS_GETGRMEM]);
+			*errnop = EAGAIN;
+			return NSS_STATUS_UNAVAIL;
+		}
+		while (sqlite3_step(mem) == SQLITE_ROW)
+			n++;
+		sqlite3_reset(mem);
+	}
+
+	/* the member array goes first, suitably aligned */
+	align = (sizeof(char *) - ((uintptr_t)buf % sizeof(char *))) % sizeof(char *);
+	if (align + (n + 1) * sizeof(char *) > buflen) {
+		stmt_done(mem, c->nss[NSS_GETGRMEM]);
+		goto erange;
+	}
+	gr->gr_mem = (char **)(buf + align);
+	buf += align + (n + 1) * sizeof(char *);
+	buflen -= align + (n + 1) * sizeof(char *);
+
+	n = 0;
+	while (mem && sqlite3_step(mem) == SQLITE_ROW) {
+		if (!(gr->gr_mem[n++] = pack(mem, 0, &buf, &buflen))) {
+			stmt_done(mem, c->nss[NSS_GETGRMEM]);
+			goto erange;
+		}
+	}
+	gr->gr_mem[n] = NULL;
+	stmt_done(mem, c->nss[NSS_GETGRMEM]);
+	return NSS_STATUS_SUCCESS;
+
+erange:
+	*errnop = ERANGE;
+	return NSS_STATUS_TRYAGAIN;
+}
+
+/* run a point lookup and fill in the result from its first row */
+static enum nss_status
+lookup(int query, const char *name, int64_t id, void *result, char *buf,
+	size_t buflen, int *errnop)
+{
+	struct p3auth_conn *c;
+	sqlite3_stmt *vm = NULL;
+	enum nss_status status;
+	int res;
+
+	if (!get_ctx() || !ctx->nss[query].sql)
+		return NSS_STATUS_UNAVAIL;
+	if (!(c = conn_get(ctx))) {
+		*errnop = EAGAIN;
+		return NSS_STATUS_UNAVAIL;
+	}
+
+	if (conn_stmt(ctx, c, &ctx->nss[query], &c->nss[query], name, NULL,
+			NULL, &vm) != SQLITE_OK) {
+		*errnop = EAGAIN;
+		status = NSS_STATUS_UNAVAIL;
+		goto done;
+	}
+	if (!name)
+		sqlite3_bind_int64(vm, 4, id);
+
+	if ((res = sqlite3_step(vm)) == SQLITE_DONE) {
+		*errnop = ENOENT;
+		status = NSS_STATUS_NOTFOUND;
+	} else if (res != SQLITE_ROW) {
+		*errnop = EAGAIN;
+		status = NSS_STATUS_UNAVAIL;
+	} else if (query <= NSS_GETPWENT) {
+		status = fill_passwd(vm, result, buf, buflen, errnop);
+	} else {
+		status = fill_group(c, vm, result, buf, buflen, errnop);
+	}
+
+done:
+	stmt_done(vm, c->nss[query]);
+	conn_put(ctx, c);
+	return status;
+}
+
+/* finish a listing; the caller holds cur->lock */
+static void
+cursor_close(struct cursor *cur)
+{
+	/* a listing inherited over fork() belongs to the parent's SQLite */
+	if (cur->conn && cur->pid == getpid()) {
+		stmt_done(cur->vm, NULL);
+		conn_put(ctx, cur->conn);
+	}
+	cur->conn = NULL;
+	cur->vm = NULL;
+	cur->pending = 0;
+	cur->eof = 0;
+}
+
+/* start a listing; the caller holds cur->lock */
+static enum nss_status
+cursor_open(struct cursor *cur, int query)
+{
+	struct p3auth_query *q;
+	int res;
+
+	cursor_close(cur);
+	if (!get_ctx() || !ctx->nss[query].sql)
+		return NSS_STATUS_UNAVAIL;
+	if (!(cur->conn = conn_get(ctx)))
+		return NSS_STATUS_UNAVAIL;
+	cur->pid = getpid();
+
+	/* a private statement, it stays open across calls */
+	q = &ctx->nss[query];
+	if (q->bind)
+		res = sqlite3_prepare_v2(cur->conn->db, q->sql, -1, &cur->vm, NULL);
+	else
+		res = conn_stmt(ctx, cur->conn, q, NULL, NULL, NULL, NULL, &cur->vm);
+	if (res != SQLITE_OK || !cur->vm) {
+		cursor_close(cur);
+		return NSS_STATUS_UNAVAIL;
+	}
+	return NSS_STATUS_SUCCESS;
+}
+
+/* the next row of a listing; the caller holds cur->lock */
+static enum nss_status
+cursor_next(struct cursor *cur, int query, int *errnop)
+{
+	int res;
+
+	if ((!cur->conn || cur->pid != getpid()) &&
+			cursor_open(cur, query) != NSS_STATUS_SUCCESS) {
+		*errnop = EAGAIN;
+		return NSS_STATUS_UNAVAIL;
+	}
+	if (cur->pending) {
+		cur->pending = 0;
+		return NSS_STATUS_SUCCESS;
+	}
+	/* stepping a finished statement would start it over */
+	if (cur->eof) {
+		*errnop = ENOENT;
+		return NSS_STATUS_NOTFOUND;
+	}
+	if ((res = sqlite3_step(cur->vm)) == SQLITE_ROW)
+		return NSS_STATUS_SUCCESS;
+	cur->eof = res == SQLITE_DONE;
+	*errnop = res == SQLITE_DONE ? ENOENT : EAGAIN;
+	return res == SQLITE_DONE ? NSS_STATUS_NOTFOUND : NSS_STATUS_UNAVAIL;
+}
+
+enum nss_status
+_nss_sqlite3_getpwnam_r(const char *name, struct passwd *pw, char *buf,
+	size_t buflen, int *errnop)
+{
+	return lookup(NSS_GETPWNAM, name, 0, pw, buf, buflen, errnop);
+}
+
+enum nss_status
+_nss_sqlite3_getpwuid_r(uid_t uid, struct passwd *pw, char *buf,
+	size_t buflen, int *errnop)
+{
+	return lookup(NSS_GETPWUID, NULL, uid, pw, buf, buflen, errnop);
+}
+
+enum nss_status
+_nss_sqlite3_setpwent(int stayopen)
+{
+	enum nss_status status;
+
+	pthread_mutex_lock(&pwent.lock);
+	status = cursor_open(&pwent, NSS_GETPWENT);
+	pthread_mutex_unlock(&pwent.lock);
+	return status;
+}
+
+enum nss_status
+_nss_sqlite3_getpwent_r(struct passwd *pw, char *buf, size_t buflen,
+	int *errnop)
+{
+	enum nss_status status;
+
+	pthread_mutex_lock(&pwent.lock);
+	if ((status = cursor_next(&pwent, NSS_GETPWENT, errnop)) == NSS_STATUS_SUCCESS &&
+			(status = fill_passwd(pwent.vm, pw, buf, buflen, errnop)) == NSS_STATUS_TRYAGAIN)
+		pwent.pending = 1;
+	pthread_mutex_unlock(&pwent.lock);
+	return status;
+}
+
+enum nss_status
+_nss_sqlite3_endpwent(void)
+{
+	pthread_mutex_lock(&pwent.lock);
+	cursor_close(&pwent);
+	pthread_mutex_unlock(&pwent.lock);
+	return NSS_STATUS_SUCCESS;
+}
+
+enum nss_status
+_nss_sqlite3_getgrnam_r(const char *name, struct group *gr, char *buf,
+	size_t buflen, int *errnop)
+{
+	return lookup(NSS_GETGRNAM, name, 0, gr, buf, buflen, errnop);
+}
+
+enum nss_status
+_nss_sqlite3_getgrgid_r(gid_t gid, struct group *gr, char *buf,
+	size_t buflen, int *errnop)
+{
+	return lookup(NSS_GETGRGID, NULL, gid, gr, buf, buflen, errnop);
+}
+
+enum nss_status
+_nss_sqlite3_setgrent(int stayopen)
+{
+	enum nss_status status;
+
+	pthread_mutex_lock(&grent.lock);
+	status = cursor_open(&grent, NSS_GETGRENT);
+	pthread_mutex_unlock(&grent.lock);
+	return status;
+}
+
+enum nss_status
+_nss_sqlite3_getgrent_r(struct group *gr, char *buf, size_t buflen,
+	int *errnop)
+{
+	enum nss_status status;
+
+	pthread_mutex_lock(&grent.lock);
+	if ((status = cursor_next(&grent, NSS_GETGRENT, errnop)) == NSS_STATUS_SUCCESS &&
+			(status = fill_group(grent.conn, grent.vm, gr, buf, buflen,
+				errnop)) == NSS_STATUS_TRYAGAIN)
+		grent.pending = 1;
+	pthread_mutex_unlock(&grent.lock);
+	return status;
+}
+
+enum nss_status
+_nss_sqlite3_endgrent(void)
+{
+	pthread_mutex_lock(&grent.lock);
+	cursor_close(&grent);
+	pthread_mutex_unlock(&grent.lock);
+	return NSS_STATUS_SUCCESS;
+}
@@ -0,0 +1,1326 @@
+/*
+ * p3auth: the pam_sqlite3 authentication engine, see p3auth.h
+ *
+ * This file is part of pam_sqlite3, see pam_sqlite3.c for copyright and
+ * licensing information.
+ */
+
+#include "pam_sqlite3_int.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#define SQL_VERIFY			"SELECT %Op FROM %Ot WHERE %Ou='%U'"
+#define SQL_VERIFY_IN_DB	"SELECT pam_verify(%Op, '%P') FROM %Ot WHERE %Ou='%U'"
+#define SQL_CHECK_EXPIRED	"SELECT 1 from %Ot WHERE %Ou='%U' AND (%Ox='y' OR %Ox='1')"
+#define SQL_CHECK_NEWTOK	"SELECT 1 FROM %Ot WHERE %Ou='%U' AND (%On='y' OR %On='1')"
+#define SQL_SET_PASSWD		"UPDATE %Ot SET %Op='%P' WHERE %Ou='%U'"
+
+#define SQL_NSS_PASSWD		"SELECT %Ou, 'x', uid, gid, gecos, home, shell FROM %Ot"
+#define SQL_GETPWNAM		SQL_NSS_PASSWD " WHERE %Ou='%U'"
+#define SQL_GETPWUID		SQL_NSS_PASSWD " WHERE uid=%I"
+#define SQL_GETPWENT		SQL_NSS_PASSWD
+
+#define AUTHZ_GROUP_SEP		", \t"
+
+/* buffers that may hold a password (secret is set) come from the secret pool */
+#define BUF_FREE(buf)			(secret ? secret_free(buf) : free(buf))
+#define BUF_REALLOC(buf, n)		(secret ? secret_realloc(buf, n) : realloc(buf, n))
+
+#define FAIL(MSG) 		\
+	{ 					\
+		SYSLOGERR(MSG);	\
+		BUF_FREE(buf);	\
+		return NULL; 	\
+	}
+
+#define GROW(x)		if (x > buflen - dest - 1) {       		\
+	char *grow;                                        		\
+	buflen += 256 + x;                                 		\
+	grow = BUF_REALLOC(buf, buflen + 256 + x);         		\
+	if (grow == NULL) FAIL("Out of memory building query"); \
+	buf = grow;                                        		\
+}
+
+#define APPEND(str, len)	GROW(len); memcpy(buf + dest, str, len); dest += len
+#define APPENDS(str)	len = strlen(str); APPEND(str, len)
+
+#define MAX_ZSQL -1
+
+/*
+ * Being very defensive here. The current logic in the rest of the code should prevent this from
+ * happening. But lets protect against future code changes which could cause a NULL ptr to creep
+ * in.
+ */
+#define CHECK_STRING(str) 													 	\
+	if (!str) 															    	\
+		FAIL("Internal error in format_query: string ptr " #str " was NULL");
+
+/* the query comes from the secret pool: release it with secret_free() */
+char *format_query(const char *template, struct module_options *options,
+	const char *user, const char *passwd, const char *host)
+{
+	const int secret = 1;
+	char *buf = secret_alloc(256);
+	if (!buf)
+		return NULL;
+
+	int buflen = 256;
+	int dest = 0, len;
+	const char *src = template;
+	char *pct;
+	char *tmp;
+	const char *c;
+
+	while (*src) {
+		pct = strchr(src, '%');
+		if (pct && pct[1] == '\0')
+			pct = NULL;		/* a lone trailing % is copied as is */
+
+		if (pct) {
+			/* copy from current position to % char into buffer */
+			if (pct != src) {
+				len = pct - src;
+				APPEND(src, len);
+			}
+
+			/* decode the escape */
+			switch(pct[1]) {
+				case 'U':	/* username */
+					if (user) {
+						tmp = sqlite3_mprintf("%q", user);
+						if (!tmp)
+							FAIL("sqlite3_mprintf out of memory");
+						len = strlen(tmp);
+						APPEND(tmp, len);
+						sqlite3_free(tmp);
+					}
+					break;
+				case 'P':	/* password */
+					/* quoted in place, sqlite3_mprintf() would leave a copy on the heap */
+					for (c = passwd; c && *c; c++) {
+						if (*c == '\'') {
+							APPEND("'", 1);
+						}
+						APPEND(c, 1);
+					}
+					break;
+				case 'H':	/* remote host */
+					if (host) {
+						tmp = sqlite3_mprintf("%q", host);
+						if (!tmp)
+							FAIL("sqlite3_mprintf out of memory");
+						len = strlen(tmp);
+						APPEND(tmp, len);
+						sqlite3_free(tmp);
+					}
+					break;
+
+				case 'I':	/* numeric id, always bound */
+					APPEND("?4", 2);
+					break;
+
+				case 'O':	/* option value */
+					if (!pct[2])
+						break;
+					pct++;
+					switch (pct[1]) {
+						case 'p':	/* passwd */
+							CHECK_STRING(options->pwd_column);
+							APPENDS(options->pwd_column);
+							break;
+						case 'u':	/* username */
+							CHECK_STRING(options->user_column);
+							APPENDS(options->user_column);
+							break;
+						case 't':	/* table */
+							CHECK_STRING(options->table);
+							APPENDS(options->table);
+							break;
+						case 'x':	/* expired */
+							CHECK_STRING(options->expired_column);
+							APPENDS(options->expired_column);
+							break;
+						case 'n':	/* newtok */
+							CHECK_STRING(options->newtok_column);
+							APPENDS(options->newtok_column);
+							break;
+					}
+					break;
+
+				case '%':	/* quoted % sign */
+					APPEND(pct, 1);
+					break;
+
+				default:	/* unknown */
+					APPEND(pct, 2);
+					break;
+			}
+			src = pct + 2;
+		} else {
+			/* copy rest of string into buffer and we're done */
+			len = strlen(src);
+			APPEND(src, len);
+			break;
+		}
+	}
+
+	buf[dest] = '\0';
+	PROBE2(format__done, template, dest);
+	return buf;
+}
+
+/* value of the option named by a %O<c> escape, *known is cleared for bad <c> */
+static const char *
+option_escape(struct module_options *options, char c, int *known)
+{
+	*known = 1;
+	switch (c) {
+		case 'p':	return options->pwd_column;
+		case 'u':	return options->user_column;
+		case 't':	return options->table;
+		case 'x':	return options->expired_column;
+		case 'n':	return options->newtok_column;
+	}
+	*known = 0;
+	return NULL;
+}
+
+/*
+ * Compile a template for repeated use.  %O and %% are expanded now, and a
+ * '%U', '%P' or '%H' standing alone as an SQL string becomes the parameter
+ * ?1, ?2 or ?3, so no quoting is needed per call.  *bind is cleared when
+ * they appear anywhere else; such templates go through format_query() on
+ * every call instead.  %I, a uid or gid for the NSS lookups, is always
+ * the parameter ?4.  *passwd is set if the template uses %P at all.  Returns
+ * NULL if an escape names an option that isn't set.
+ */
+static char *
+compile_query(const char *template, struct module_options *options, int *bind,
+	int *passwd)
+{
+	const int secret = 0;
+	char *buf = malloc(256);
+	int buflen = 256;
+	int dest = 0, len, known, quoted = 0;
+	const char *src, *val;
+
+	if (!buf)
+		return NULL;
+
+	*bind = 1;
+	*passwd = 0;
+	for (src = template; *src; src++) {
+		if (*src == '\'') {
+			/* a quote right after a closing one is an escaped '' */
+			if (!quoted && src[1] == '%' && src[2] && strchr("UPH", src[2]) &&
+					src[3] == '\'' && (src == template || src[-1] != '\'')) {
+				if (src[2] == 'P')
+					*passwd = 1;
+				APPEND(src[2] == 'U' ? "?1" : src[2] == 'P' ? "?2" : "?3", 2);
+				src += 3;
+				continue;
+			}
+			quoted = !quoted;
+			APPEND(src, 1);
+			continue;
+		}
+		if (*src != '%' || !src[1]) {
+			APPEND(src, 1);
+			continue;
+		}
+
+		switch (src[1]) {
+			case 'P':
+				*passwd = 1;
+				/* fall through */
+			case 'U':
+			case 'H':
+				*bind = 0;
+				APPEND(src, 2);
+				break;
+			case 'I':
+				APPEND("?4", 2);
+				break;
+			case 'O':
+				if (!src[2])
+					break;
+				val = option_escape(options, src[2], &known);
+				if (known && !val) {
+					free(buf);
+					return NULL;
+				}
+				if (val) {
+					APPENDS(val);
+				}
+				src++;
+				break;
+			case '%':
+				APPEND(src, 1);
+				break;
+			default:
+				APPEND(src, 2);
+				break;
+		}
+		src++;
+	}
+
+	buf[dest] = '\0';
+	return buf;
+}
+
+static void
+prepare_query(struct p3auth_query *q, const char *template,
+	struct module_options *options)
+{
+	q->sql = compile_query(template, options, &q->bind, &q->passwd);
+	if (q->sql && !q->bind) {
+		free(q->sql);
+		q->sql = strdup(template);
+	}
+}
+
+static void
+free_query(struct p3auth_query *q)
+{
+	free(q->sql);
+	q->sql = NULL;
+}
+
+/* bind user, password and host to the ?1, ?2 and ?3 of a compiled query */
+static void
+bind_params(sqlite3_stmt *vm, const char *user, const char *passwd,
+	const char *host)
+{
+	int nparams = sqlite3_bind_parameter_count(vm);
+
+	/* format_query() expands a missing value to '', so bind the same */
+	if (nparams >= 1)
+		sqlite3_bind_text(vm, 1, user ? user : "", -1, SQLITE_STATIC);
+	if (nparams >= 2)
+		sqlite3_bind_text(vm, 2, passwd ? passwd : "", -1, SQLITE_STATIC);
+	if (nparams >= 3)
+		sqlite3_bind_text(vm, 3, host ? host : "", -1, SQLITE_STATIC);
+}
+
+/* prepare the first statement in sql, binding user and password for compiled queries */
+static int
+query_prepare(sqlite3 *conn, const char *sql, int bind, const char *user,
+	const char *passwd, sqlite3_stmt **vm, const char **tail)
+{
+	int res;
+
+	res = sqlite3_prepare_v2(conn, sql, MAX_ZSQL, vm, tail);
+	if (res != SQLITE_OK || !*vm || !bind)
+		return res;
+
+	bind_params(*vm, user, passwd, NULL);
+	return SQLITE_OK;
+}
+
+/*
+ * open SQLite database at path; every connection is used by one thread at
+ * a time, so SQLite's own per-connection mutex would only cost time
+ */
+sqlite3 *pam_sqlite3_connect(struct module_options *options, const char *path,
+	int flags)
+{
+  const char *errtext = NULL;
+  sqlite3 *sdb = NULL;
+
+  PROBE1(connect__start, path);
+  if (sqlite3_open_v2(path, &sdb, flags | SQLITE_OPEN_NOMUTEX,
+		  NULL) != SQLITE_OK) {
+      errtext = sqlite3_errmsg(sdb);
+	  SYSLOG("Error opening SQLite database (%s)", errtext);
+	  /*
+	   * N.B. sdb is usually non-NULL when errors occur, so we explicitly
+	   * release the resource and return NULL to indicate failure to the caller.
+	   */
+
+	  sqlite3_close(sdb);
+	  PROBE2(connect__done, path, 0);
+	  return NULL;
+  }
+  register_sql_functions(sdb, options);
+  PROBE2(connect__done, path, 1);
+
+  return sdb;
+}
+
+static void
+conn_close(struct p3auth_conn *c)
+{
+	int i;
+
+	for (i = 0; i < NSS_NQUERIES; i++)
+		sqlite3_finalize(c->nss[i]);
+	sqlite3_finalize(c->verify);
+	sqlite3_finalize(c->check_expired);
+	sqlite3_finalize(c->check_newtok);
+	sqlite3_finalize(c->check_group);
+	sqlite3_finalize(c->check_host);
+	sqlite3_close(c->db);
+	free(c);
+}
+
+/* forget connections inherited over fork(), SQLite must not touch them */
+static void
+conn_forget(p3auth_ctx *ctx)
+{
+	struct p3auth_conn *c;
+
+	while ((c = ctx->idle)) {
+		ctx->idle = c->next;
+		free(c);
+	}
+	ctx->nidle = 0;
+	free(ctx->writer);
+	ctx->writer = NULL;
+	ctx->pid = getpid();
+}
+
+/* c if it still refers to the file at path, else a new connection */
+static struct p3auth_conn *
+conn_check(p3auth_ctx *ctx, struct p3auth_conn *c, const char *path, int flags)
+{
+	struct stat st;
+
+	/* the file may have been replaced since, e.g. by an atomic rename */
+	if (c && (stat(path, &st) != 0 ||
+			st.st_dev != c->dev || st.st_ino != c->ino)) {
+		conn_close(c);
+		c = NULL;
+	}
+	if (c)
+		return c;
+
+	if (!(c = calloc(1, sizeof(*c))))
+		return NULL;
+	if (path == ctx->options->replica)
+		c->db = replica_connect(ctx, flags);
+	else
+		c->db = pam_sqlite3_connect(ctx->options, path, flags);
+	if (!c->db) {
+		free(c);
+		return NULL;
+	}
+	if (stat(path, &st) == 0) {
+		c->dev = st.st_dev;
+		c->ino = st.st_ino;
+	}
+	return c;
+}
+
+/*
+ * Take an idle read-only connection to the database, or its replica if
+ * one is configured, or open a new one.
+ * A thread gets back the connection it used last when that one is idle,
+ * so its statements and pages stay in the thread's caches and malloc arena.
+ */
+struct p3auth_conn *
+conn_get(p3auth_ctx *ctx)
+{
+	struct p3auth_conn *c, **p;
+	pthread_t self = pthread_self();
+
+	pthread_mutex_lock(&ctx->conn_lock);
+	if (ctx->pid != getpid())
+		conn_forget(ctx);
+	for (p = &ctx->idle; *p; p = &(*p)->next)
+		if (pthread_equal((*p)->owner, self))
+			break;
+	if (!*p)
+		p = &ctx->idle;
+	if ((c = *p)) {
+		*p = c->next;
+		ctx->nidle--;
+	}
+	pthread_mutex_unlock(&ctx->conn_lock);
+
+	gen_note_use(ctx);
+	if ((c = conn_check(ctx, c, replica_path(ctx), SQLITE_OPEN_READONLY)))
+		c->owner = self;
+	return c;
+}
+
+/* hand a connection back for reuse */
+void
+conn_put(p3auth_ctx *ctx, struct p3auth_conn *c)
+{
+	if (!c)
+		return;
+
+	/* a template that left a transaction open must not leak it to the next user */
+	pthread_mutex_lock(&ctx->conn_lock);
+	if (ctx->pid == getpid() && ctx->nidle < ctx->options->reader_connections &&
+			sqlite3_get_autocommit(c->db)) {
+		c->next = ctx->idle;
+		ctx->idle = c;
+		ctx->nidle++;
+		c = NULL;
+	}
+	pthread_mutex_unlock(&ctx->conn_lock);
+
+	if (c)
+		conn_close(c);
+}
+
+/*
+ * Take the connection that may write, waiting for any other thread using
+ * it.  SQLite admits one writer at a time anyway.
+ */
+struct p3auth_conn *
+conn_get_writer(p3auth_ctx *ctx)
+{
+	struct p3auth_conn *c;
+
+	pthread_mutex_lock(&ctx->writer_lock);
+	pthread_mutex_lock(&ctx->conn_lock);
+	if (ctx->pid != getpid())
+		conn_forget(ctx);
+	pthread_mutex_unlock(&ctx->conn_lock);
+
+	gen_note_use(ctx);
+	if (!(c = ctx->writer = conn_check(ctx, ctx->writer,
+			ctx->options->database, SQLITE_OPEN_READWRITE)))
+		pthread_mutex_unlock(&ctx->writer_lock);
+	return c;
+}
+
+void
+conn_put_writer(p3auth_ctx *ctx, struct p3auth_conn *c)
+{
+	if (!c)
+		return;
+	if (!sqlite3_get_autocommit(c->db)) {
+		conn_close(c);
+		ctx->writer = NULL;
+	}
+	pthread_mutex_unlock(&ctx->writer_lock);
+}
+
+/*
+ * Get a statement for q on c with user, passwd and host in place.
+ * Compiled queries use the statement cached in *cache, prepared on first
+ * use; others are built for this call and stmt_done() finalizes them.
+ */
+int
+conn_stmt(p3auth_ctx *ctx, struct p3auth_conn *c, struct p3auth_query *q,
+	sqlite3_stmt **cache, const char *user, const char *passwd,
+	const char *host, sqlite3_stmt **vm)
+{
+	struct module_options *options = ctx->options;
+	const char *tail = NULL;
+	char *query = NULL;
+	int res;
+
+	*vm = NULL;
+	if (!q->sql || (!q->bind &&
+			!(query = format_query(q->sql, options, user, passwd, host)))) {
+		SYSLOGERR("failed to construct sql query");
+		return SQLITE_ERROR;
+	}
+
+	DBGLOG("query: %s", query ? query : q->sql);
+
+	if (query) {
+		res = sqlite3_prepare_v2(c->db, query, MAX_ZSQL, vm, &tail);
+		secret_free(query);
+		return res;
+	}
+
+	if (!*cache &&
+			(res = sqlite3_prepare_v2(c->db, q->sql, MAX_ZSQL, cache, &tail)) != SQLITE_OK)
+		return res;
+	if ((*vm = *cache))
+		bind_params(*vm, user, passwd, host);
+	return SQLITE_OK;
+}
+
+/*
+ * sqlite3_step() between the query__start and query__done probes; what
+ * names the query, as its SQL may hold a password
+ */
+int
+stmt_step(sqlite3_stmt *vm, const char *what)
+{
+	int res;
+
+	PROBE1(query__start, what);
+	res = sqlite3_step(vm);
+	PROBE2(query__done, what, res);
+	return res;
+}
+
+/* release a statement from conn_stmt(), leaving a cached one ready for reuse */
+void
+stmt_done(sqlite3_stmt *vm, sqlite3_stmt *cache)
+{
+	if (!vm)
+		return;
+	if (vm == cache) {
+		sqlite3_reset(vm);
+		sqlite3_clear_bindings(vm);
+	} else {
+		sqlite3_finalize(vm);
+	}
+}
+
+p3auth_ctx *
+p3auth_new(void)
+{
+	p3auth_ctx *ctx;
+
+	if (!(ctx = calloc(1, sizeof(*ctx))))
+		return NULL;
+	if (!(ctx->options = calloc(1, sizeof(*ctx->options)))) {
+		free(ctx);
+		return NULL;
+	}
+	ctx->options->pw_type = PW_CLEAR;
+	ctx->options->hash_queue_timeout = 1000;
+	ctx->options->recent_login_window = 3600;
+	ctx->options->audit_batch = 64;
+	ctx->options->audit_flush_ms = 1000;
+	ctx->options->changelog_poll_ms = 1000;
+	ctx->options->replica_refresh_ms = 1000;
+	ctx->options->reader_connections = CONN_CACHE_MAX;
+	pthread_mutex_init(&ctx->conn_lock, NULL);
+	pthread_mutex_init(&ctx->writer_lock, NULL);
+	pthread_mutex_init(&ctx->group_lock, NULL);
+	ctx->pid = getpid();
+	return ctx;
+}
+
+int
+p3auth_set_service(p3auth_ctx *ctx, const char *service)
+{
+	char *dup = NULL;
+
+	if (service && !(dup = strdup(service)))
+		return -1;
+	free(ctx->options->service);
+	ctx->options->service = dup;
+	return 0;
+}
+
+void
+p3auth_set_option(p3auth_ctx *ctx, const char *option)
+{
+	set_module_option(option, ctx->options);
+}
+
+int
+p3auth_load_config(p3auth_ctx *ctx, const char *filename)
+{
+	return get_module_options_from_file(filename, ctx->options, 0);
+}
+
+static int
+compare_names(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* split allowed_groups into a sorted vector and set up the membership cache */
+static int
+prepare_groups(p3auth_ctx *ctx)
+{
+	struct module_options *options = ctx->options;
+	char *list, *name, *save = NULL;
+	int n = 1;
+
+	if (!options->sql_check_group)
+		return 0;
+	if (options->group_cache_ttl > 0 &&
+			!(ctx->members = calloc(GROUP_CACHE_SLOTS, sizeof(*ctx->members))))
+		return -1;
+	if (!options->allowed_groups)
+		return 0;
+
+	for (name = options->allowed_groups; *name; name++)
+		if (strchr(AUTHZ_GROUP_SEP, *name))
+			n++;
+	if (!(list = strdup(options->allowed_groups)) ||
+			!(ctx->allowed_groups = calloc(n, sizeof(char *)))) {
+		free(list);
+		return -1;
+	}
+	for (name = strtok_r(list, AUTHZ_GROUP_SEP, &save); name;
+			name = strtok_r(NULL, AUTHZ_GROUP_SEP, &save)) {
+		if (!(ctx->allowed_groups[ctx->nallowed] = strdup(name))) {
+			free(list);
+			return -1;
+		}
+		ctx->nallowed++;
+	}
+	free(list);
+	qsort(ctx->allowed_groups, ctx->nallowed, sizeof(char *), compare_names);
+	return 0;
+}
+
+int
+p3auth_prepare(p3auth_ctx *ctx)
+{
+	struct module_options *options;
+
+	if (options_valid(ctx ? ctx->options : NULL) != 0)
+		return -1;
+
+	options = ctx->options;
+	prepare_query(&ctx->verify, options->sql_verify ?
+		options->sql_verify : options->verify_in_db ? SQL_VERIFY_IN_DB : SQL_VERIFY,
+		options);
+	if (options->expired_column || options->sql_check_expired)
+		prepare_query(&ctx->check_expired, options->sql_check_expired ?
+			options->sql_check_expired : SQL_CHECK_EXPIRED, options);
+	if (options->newtok_column || options->sql_check_newtok)
+		prepare_query(&ctx->check_newtok, options->sql_check_newtok ?
+			options->sql_check_newtok : SQL_CHECK_NEWTOK, options);
+	prepare_query(&ctx->set_passwd, options->sql_set_passwd ?
+		options->sql_set_passwd : SQL_SET_PASSWD, options);
+	if (options->sql_check_group)
+		prepare_query(&ctx->check_group, options->sql_check_group, options);
+	if (options->sql_check_host)
+		prepare_query(&ctx->check_host, options->sql_check_host, options);
+	if (prepare_groups(ctx) != 0)
+		return -1;
+
+	/* failing to set up admission control or the cache feed is logged but not fatal */
+	admit_open(ctx);
+	gen_open(ctx);
+	if (trail_open(ctx) != 0 || trace_open(ctx) != 0 || sess_open(ctx) != 0)
+		return -1;
+	return 0;
+}
+
+/* compile the sql_get* templates; the group ones have no default */
+void
+nss_prepare(p3auth_ctx *ctx)
+{
+	static const char *const defaults[NSS_NQUERIES] = {
+		SQL_GETPWNAM, SQL_GETPWUID, SQL_GETPWENT,
+	};
+	struct module_options *options = ctx->options;
+	const char *template;
+	int i;
+
+	for (i = 0; i < NSS_NQUERIES; i++)
+		if ((template = options->sql_nss[i] ? options->sql_nss[i] : defaults[i]))
+			prepare_query(&ctx->nss[i], template, options);
+}
+
+void
+p3auth_free(p3auth_ctx *ctx)
+{
+	struct p3auth_conn *c;
+	int i;
+
+	if (!ctx)
+		return;
+
+	trail_close(ctx);
+	trace_close(ctx);
+	sess_close(ctx);
+	if (ctx->pid != getpid())
+		conn_forget(ctx);
+	while ((c = ctx->idle)) {
+		ctx->idle = c->next;
+		conn_close(c);
+	}
+	if (ctx->writer)
+		conn_close(ctx->writer);
+	pthread_mutex_destroy(&ctx->conn_lock);
+	pthread_mutex_destroy(&ctx->writer_lock);
+
+	free_query(&ctx->verify);
+	free_query(&ctx->check_expired);
+	free_query(&ctx->check_newtok);
+	free_query(&ctx->set_passwd);
+	free_query(&ctx->check_group);
+	free_query(&ctx->check_host);
+	for (i = 0; i < NSS_NQUERIES; i++)
+		free_query(&ctx->nss[i]);
+	while (ctx->nallowed)
+		free(ctx->allowed_groups[--ctx->nallowed]);
+	free(ctx->allowed_groups);
+	if (ctx->members) {
+		for (i = 0; i < GROUP_CACHE_SLOTS; i++)
+			free(ctx->members[i].user);
+		free(ctx->members);
+	}
+	pthread_mutex_destroy(&ctx->group_lock);
+	admit_close(ctx);
+	gen_close(ctx);
+	free_module_options(ctx->options);
+	free(ctx);
+}
+
+/* prepare a compiled query into its statement cache slot */
+static void
+warm_stmt(struct p3auth_conn *c, struct p3auth_query *q, sqlite3_stmt **cache)
+{
+	if (q->sql && q->bind && !*cache)
+		sqlite3_prepare_v2(c->db, q->sql, MAX_ZSQL, cache, NULL);
+}
+
+int
+p3auth_warm(p3auth_ctx *ctx)
+{
+	struct p3auth_conn *c;
+
+	if (!(c = conn_get(ctx)))
+		return P3AUTH_AUTHINFO_UNAVAIL;
+	warm_stmt(c, &ctx->verify, &c->verify);
+	warm_stmt(c, &ctx->check_expired, &c->check_expired);
+	warm_stmt(c, &ctx->check_newtok, &c->check_newtok);
+	warm_stmt(c, &ctx->check_group, &c->check_group);
+	warm_stmt(c, &ctx->check_host, &c->check_host);
+	conn_put(ctx, c);
+	return P3AUTH_SUCCESS;
+}
+
+void
+p3auth_release_connections(p3auth_ctx *ctx)
+{
+	struct p3auth_conn *idle, *writer, *c;
+
+	pthread_mutex_lock(&ctx->writer_lock);
+	pthread_mutex_lock(&ctx->conn_lock);
+	if (ctx->pid != getpid())
+		conn_forget(ctx);
+	idle = ctx->idle;
+	ctx->idle = NULL;
+	ctx->nidle = 0;
+	writer = ctx->writer;
+	ctx->writer = NULL;
+	pthread_mutex_unlock(&ctx->conn_lock);
+	pthread_mutex_unlock(&ctx->writer_lock);
+
+	while ((c = idle)) {
+		idle = c->next;
+		conn_close(c);
+	}
+	if (writer)
+		conn_close(writer);
+}
+
+const char *
+p3auth_strerror(int rc)
+{
+	switch (rc) {
+		case P3AUTH_SUCCESS:			return "success";
+		case P3AUTH_AUTH_ERR:			return "authentication failure";
+		case P3AUTH_USER_UNKNOWN:		return "user unknown";
+		case P3AUTH_ACCT_EXPIRED:		return "account expired";
+		case P3AUTH_NEW_AUTHTOK_REQD:	return "password change required";
+		case P3AUTH_AUTHINFO_UNAVAIL:	return "authentication information unavailable";
+		case P3AUTH_BUF_ERR:			return "out of memory";
+		case P3AUTH_PERM_DENIED:		return "permission denied";
+		case P3AUTH_AUTHTOK_ERR:		return "password used before";
+	}
+	return "unknown error";
+}
+
+/* fetch the stored password for user into *stored, from the secret pool */
+static int
+auth_lookup(p3auth_ctx *ctx, struct p3auth_conn *c, const char *user,
+	const char *passwd, char **stored)
+{
+	struct module_options *options = ctx->options;
+	sqlite3_stmt *vm = NULL;
+	int rc = P3AUTH_AUTH_ERR;
+
+	if (conn_stmt(ctx, c, &ctx->verify, &c->verify, user, passwd, NULL, &vm) != SQLITE_OK) {
+		DBGLOG("Error executing SQLite query (%s)", sqlite3_errmsg(c->db));
+		goto done;
+	}
+
+	if (SQLITE_ROW != stmt_step(vm, "verify")) {
+		rc = P3AUTH_USER_UNKNOWN;
+		DBGLOG("no rows to retrieve");
+	} else {
+		const char *stored_pw = (const char *) sqlite3_column_text(vm, 0);
+
+		if (!stored_pw) {
+			SYSLOG("sqlite3 failed to return row data");
+			goto done;
+		}
+		if (!(*stored = secret_strdup(stored_pw))) {
+			rc = P3AUTH_BUF_ERR;
+			goto done;
+		}
+		rc = P3AUTH_SUCCESS;
+	}
+
+done:
+	stmt_done(vm, c->verify);
+	return rc;
+}
+
+/*
+ * Compare a password against the stored one for the configured scheme.
+ * crypt() is only run once admission control hands out a slot.
+ */
+static int
+auth_compare(p3auth_ctx *ctx, uint64_t user, const char *passwd,
+	const char *stored)
+{
+	struct module_options *options = ctx->options;
+	struct crypt_data *data;
+	int rc = P3AUTH_AUTH_ERR;
+	int slot, match;
+
+	if (options->pw_type == PW_CLEAR)
+		return password_equal(passwd, stored) ? P3AUTH_SUCCESS : P3AUTH_AUTH_ERR;
+
+	if (!(data = secret_alloc(sizeof(*data))))
+		return P3AUTH_BUF_ERR;
+	if ((slot = admit_enter(ctx, user)) == -1) {
+		secret_free(data);
+		return P3AUTH_AUTHINFO_UNAVAIL;
+	}
+	match = password_matches(options, passwd, stored, data);
+	admit_leave(ctx, slot);
+	if (match < 0)
+		SYSLOG("crypt failed when encrypting password");
+	else if (match)
+		rc = P3AUTH_SUCCESS;
+	secret_free(data);
+	return rc;
+}
+
+/* connect and fetch the stored password for user */
+static int
+lookup_stored(p3auth_ctx *ctx, const char *user, const char *passwd,
+	char **stored)
+{
+	struct p3auth_conn *c;
+	int rc;
+
+	if(!(c = conn_get(ctx)))
+		return P3AUTH_AUTH_ERR;
+
+	rc = auth_lookup(ctx, c, user, passwd, stored);
+	conn_put(ctx, c);
+	return rc;
+}
+
+/* finish a verification given the result of lookup_stored(); frees stored */
+static int
+verify_stored(p3auth_ctx *ctx, const char *user, const char *passwd,
+	int rc, char *stored)
+{
+	if(rc == P3AUTH_SUCCESS) {
+		uint64_t hash = p3auth_user_hash(user);
+
+		if ((rc = auth_compare(ctx, hash, passwd, stored)) == P3AUTH_SUCCESS)
+			admit_success(ctx, hash);
+	}
+
+	secret_free(stored);
+	return rc;
+}
+
+/*
+ * verify_in_db: the verify query compares the password itself, with
+ * pam_verify(), and returns a true first column if it matched
+ */
+static int
+verify_in_query(p3auth_ctx *ctx, const char *user, const char *passwd)
+{
+	struct module_options *options = ctx->options;
+	struct p3auth_conn *c;
+	sqlite3_stmt *vm = NULL;
+	uint64_t hash = p3auth_user_hash(user);
+	int rc = P3AUTH_AUTH_ERR, slot = ADMIT_UNLIMITED;
+
+	if (!(c = conn_get(ctx)))
+		return P3AUTH_AUTH_ERR;
+	/* the query may run crypt(), so it needs a hashing slot */
+	if (options->pw_type != PW_CLEAR && (slot = admit_enter(ctx, hash)) == -1) {
+		conn_put(ctx, c);
+		return P3AUTH_AUTHINFO_UNAVAIL;
+	}
+
+	if (conn_stmt(ctx, c, &ctx->verify, &c->verify, user, passwd, NULL, &vm) != SQLITE_OK) {
+		DBGLOG("Error executing SQLite query (%s)", sqlite3_errmsg(c->db));
+	} else if (stmt_step(vm, "verify") != SQLITE_ROW) {
+		rc = P3AUTH_USER_UNKNOWN;
+		DBGLOG("no rows to retrieve");
+	} else if (sqlite3_column_int(vm, 0)) {
+		rc = P3AUTH_SUCCESS;
+	}
+	stmt_done(vm, c->verify);
+	if (options->pw_type != PW_CLEAR)
+		admit_leave(ctx, slot);
+	conn_put(ctx, c);
+
+	if (rc == P3AUTH_SUCCESS)
+		admit_success(ctx, hash);
+	return rc;
+}
+
+int
+p3auth_verify_password(p3auth_ctx *ctx, const char *user, const char *passwd)
+{
+	char *stored = NULL;
+	int rc;
+
+	if (ctx->options->verify_in_db)
+		return verify_in_query(ctx, user, passwd);
+
+	rc = lookup_stored(ctx, user, passwd, &stored);
+	return verify_stored(ctx, user, passwd, rc, stored);
+}
+
+struct p3auth_lookup {
+	p3auth_ctx *ctx;
+	char *user;
+	pthread_t thread;
+	int started;
+	int rc;
+	char *stored;
+};
+
+static void *
+lookup_thread(void *arg)
+{
+	p3auth_lookup *lk = arg;
+
+	lk->rc = lookup_stored(lk->ctx, lk->user, NULL, &lk->stored);
+	return NULL;
+}
+
+p3auth_lookup *
+p3auth_lookup_start(p3auth_ctx *ctx, const char *user)
+{
+	p3auth_lookup *lk;
+
+	if (!(lk = calloc(1, sizeof(*lk))))
+		return NULL;
+	if (!(lk->user = strdup(user))) {
+		free(lk);
+		return NULL;
+	}
+	lk->ctx = ctx;
+
+	/* a verify query that needs the password has to wait for it */
+	if (ctx->verify.passwd)
+		return lk;
+
+	if (pthread_create(&lk->thread, NULL, lookup_thread, lk) == 0)
+		lk->started = 1;
+	return lk;
+}
+
+int
+p3auth_lookup_verify(p3auth_lookup *lk, const char *passwd)
+{
+	int rc;
+
+	if (lk->started) {
+		pthread_join(lk->thread, NULL);
+		rc = verify_stored(lk->ctx, lk->user, passwd, lk->rc, lk->stored);
+	} else {
+		rc = p3auth_verify_password(lk->ctx, lk->user, passwd);
+	}
+	free(lk->user);
+	free(lk);
+	return rc;
+}
+
+void
+p3auth_lookup_cancel(p3auth_lookup *lk)
+{
+	if (!lk)
+		return;
+	if (lk->started) {
+		pthread_join(lk->thread, NULL);
+		secret_free(lk->stored);
+	}
+	free(lk->user);
+	free(lk);
+}
+
+/* run one of the account checks, returning found if it matches a row */
+static int
+account_query(p3auth_ctx *ctx, struct p3auth_conn *c, struct p3auth_query *q,
+	sqlite3_stmt **cache, const char *user, int found)
+{
+	struct module_options *options = ctx->options;
+	sqlite3_stmt *vm = NULL;
+	int res;
+
+	if ((res = conn_stmt(ctx, c, q, cache, user, NULL, NULL, &vm)) != SQLITE_OK) {
+		SYSLOGERR("query failed: %s", sqlite3_errmsg(c->db));
+		stmt_done(vm, *cache);
+		return P3AUTH_AUTH_ERR;
+	}
+
+	res = stmt_step(vm, found == P3AUTH_ACCT_EXPIRED ? "check_expired" :
+		"check_newtok");
+	stmt_done(vm, *cache);
+
+	DBGLOG("query result: %d", res);
+
+	return SQLITE_ROW == res ? found : P3AUTH_SUCCESS;
+}
+
+int
+p3auth_check_account(p3auth_ctx *ctx, const char *user)
+{
+	struct module_options *options = ctx->options;
+	struct p3auth_conn *c;
+	int rc = P3AUTH_SUCCESS;
+
+	/* both not specified, just succeed. */
+	if(options->expired_column == NULL && options->newtok_column == NULL)
+		return P3AUTH_SUCCESS;
+
+	if(!(c = conn_get(ctx))) {
+		SYSLOGERR("could not connect to database");
+		return P3AUTH_AUTH_ERR;
+	}
+
+	/* if account has expired then expired_column = '1' or 'y' */
+	if(options->expired_column || options->sql_check_expired)
+		rc = account_query(ctx, c, &ctx->check_expired, &c->check_expired,
+			user, P3AUTH_ACCT_EXPIRED);
+
+	/* if new password is required then newtok_column = 'y' or '1' */
+	if(rc == P3AUTH_SUCCESS && (options->newtok_column || options->sql_check_newtok))
+		rc = account_query(ctx, c, &ctx->check_newtok, &c->check_newtok,
+			user, P3AUTH_NEW_AUTHTOK_REQD);
+
+	conn_put(ctx, c);
+	return rc;
+}
+
+/*
+ * Is user in one of allowed_groups (or in any group, without the option)?
+ * The query returns the user's groups in its first column; every row is
+ * looked up in the sorted allowed_groups vector.
+ */
+static int
+group_query(p3auth_ctx *ctx, struct p3auth_conn *c, const char *user,
+	int *member)
+{
+	struct module_options *options = ctx->options;
+	sqlite3_stmt *vm = NULL;
+	const char *group;
+	int res;
+
+	*member = 0;
+	if ((res = conn_stmt(ctx, c, &ctx->check_group, &c->check_group, user,
+			NULL, NULL, &vm)) != SQLITE_OK) {
+		SYSLOGERR("query failed: %s", sqlite3_errmsg(c->db));
+		stmt_done(vm, c->check_group);
+		return -1;
+	}
+
+	while ((res = stmt_step(vm, "check_group")) == SQLITE_ROW) {
+		if (!(group = (const char *)sqlite3_column_text(vm, 0)))
+			continue;
+		if (!ctx->nallowed || bsearch(&group, ctx->allowed_groups,
+				ctx->nallowed, sizeof(char *), compare_names)) {
+			DBGLOG("%s is in group %s", user, group);
+			*member = 1;
+			res = SQLITE_DONE;
+			break;
+		}
+	}
+	stmt_done(vm, c->check_group);
+	return res == SQLITE_DONE ? 0 : -1;
+}
+
+/*
+ * Cached group_query() result for user, -1 if there is none.  *gen is the
+ * user's generation before the lookup, for group_remember() to store.
+ */
+static int
+group_cached(p3auth_ctx *ctx, const char *user, uint32_t *gen)
+{
+	struct p3auth_member *m;
+	uint64_t h = p3auth_user_hash(user);
+	int member = -1;
+
+	if (!ctx->members)
+		return -1;
+	gen_poll(ctx);
+	*gen = gen_current(ctx, h);
+	m = &ctx->members[h % GROUP_CACHE_SLOTS];
+	pthread_mutex_lock(&ctx->group_lock);
+	if (m->user && !strcmp(m->user, user) && m->gen == *gen &&
+			time(NULL) - m->when < ctx->options->group_cache_ttl)
+		member = m->member;
+	pthread_mutex_unlock(&ctx->group_lock);
+	return member;
+}
+
+static void
+group_remember(p3auth_ctx *ctx, const char *user, uint32_t gen, int member)
+{
+	struct p3auth_member *m;
+	char *dup;
+
+	if (!ctx->members || !(dup = strdup(user)))
+		return;
+	m = &ctx->members[p3auth_user_hash(user) % GROUP_CACHE_SLOTS];
+	pthread_mutex_lock(&ctx->group_lock);
+	free(m->user);
+	m->user = dup;
+	m->when = time(NULL);
+	m->gen = gen;
+	m->member = member;
+	pthread_mutex_unlock(&ctx->group_lock);
+}
+
+int
+p3auth_check_access(p3auth_ctx *ctx, const char *user, const char *host)
+{
+	struct module_options *options = ctx->options;
+	struct p3auth_conn *c = NULL;
+	sqlite3_stmt *vm = NULL;
+	uint32_t gen = 0;
+	int member = 0, res, rc = P3AUTH_SUCCESS;
+
+	if (!options->sql_check_group && !options->sql_check_host)
+		return P3AUTH_SUCCESS;
+
+	if (options->sql_check_group && (member = group_cached(ctx, user, &gen)) < 0) {
+		if (!(c = conn_get(ctx))) {
+			SYSLOGERR("could not connect to database");
+			return P3AUTH_AUTH_ERR;
+		}
+		if (group_query(ctx, c, user, &member) != 0) {
+			rc = P3AUTH_AUTH_ERR;
+			goto done;
+		}
+		group_remember(ctx, user, gen, member);
+	}
+	if (options->sql_check_group && !member) {
+		DBGLOG("%s is not in an allowed group", user);
+		rc = P3AUTH_PERM_DENIED;
+		goto done;
+	}
+
+	if (!options->sql_check_host)
+		goto done;
+	if (!c && !(c = conn_get(ctx))) {
+		SYSLOGERR("could not connect to database");
+		return P3AUTH_AUTH_ERR;
+	}
+	if ((res = conn_stmt(ctx, c, &ctx->check_host, &c->check_host, user,
+			NULL, host, &vm)) != SQLITE_OK) {
+		SYSLOGERR("query failed: %s", sqlite3_errmsg(c->db));
+		rc = P3AUTH_AUTH_ERR;
+	} else if ((res = stmt_step(vm, "check_host")) == SQLITE_DONE) {
+		DBGLOG("%s may not log in from %s", user, host ? host : "localhost");
+		rc = P3AUTH_PERM_DENIED;
+	} else if (res != SQLITE_ROW) {
+		SYSLOGERR("query failed: %s", sqlite3_errmsg(c->db));
+		rc = P3AUTH_AUTH_ERR;
+	}
+	stmt_done(vm, c->check_host);
+
+done:
+	conn_put(ctx, c);
+	return rc;
+}
+
+int
+p3auth_set_password(p3auth_ctx *ctx, const char *user, const char *newpass)
+{
+	struct module_options *options = ctx->options;
+	struct p3auth_query *q = &ctx->set_passwd;
+	int rc = P3AUTH_SUCCESS;
+	char *newpass_crypt = NULL;
+	struct p3auth_conn *c = NULL;
+	sqlite3 *conn;
+	sqlite3_stmt *vm = NULL;
+	const char *sql, *tail;
+	char *query = NULL;
+	int res = SQLITE_OK, reused;
+
+	if(!(newpass_crypt = encrypt_password(options, newpass))) {
+		SYSLOGERR("passwd encrypt failed");
+		return P3AUTH_BUF_ERR;
+	}
+	if(!(c = conn_get_writer(ctx))) {
+		SYSLOGERR("could not connect to database");
+		rc = P3AUTH_AUTHINFO_UNAVAIL;
+		goto done;
+	}
+	conn = c->db;
+
+	if (options->password_history > 0) {
+		/* outside the transaction, the hashes take a while */
+		if (history_create(ctx, conn) != SQLITE_OK ||
+				(reused = history_check(ctx, conn, user, newpass)) < 0) {
+			rc = P3AUTH_AUTHINFO_UNAVAIL;
+			goto done;
+		}
+		if (reused) {
+			SYSLOG("new password for '%s' was used before", user);
+			rc = P3AUTH_AUTHTOK_ERR;
+			goto done;
+		}
+	}
+
+	DBGLOG("creating query");
+
+	if(!q->sql || !(sql = q->bind ? q->sql :
+			(query = format_query(q->sql, options, user, newpass_crypt, NULL)))) {
+		SYSLOGERR("failed to construct sql query");
+		rc = P3AUTH_AUTH_ERR;
+		goto done;
+	}
+
+	DBGLOG("query: %s", sql);
+
+	/* the history moves on in the same transaction as the password */
+	if (options->password_history > 0)
+		res = sqlite3_exec(conn, "BEGIN IMMEDIATE", NULL, NULL, NULL);
+
+	/* like sqlite3_exec(), run every statement in the template */
+	while (res == SQLITE_OK && *sql) {
+		if ((res = query_prepare(conn, sql, q->bind, user, newpass_crypt,
+				&vm, &tail)) != SQLITE_OK)
+			break;
+		sql = tail;
+		if (!vm)
+			continue;
+		while ((res = stmt_step(vm, "set_passwd")) == SQLITE_ROW)
+			;
+		sqlite3_finalize(vm);
+		vm = NULL;
+		if (res != SQLITE_DONE)
+			break;
+		res = SQLITE_OK;
+	}
+	if (SQLITE_OK == res && options->password_history > 0 &&
+			(res = history_record(ctx, conn, user, newpass_crypt)) == SQLITE_OK)
+		res = sqlite3_exec(conn, "COMMIT", NULL, NULL, NULL);
+
+	if (SQLITE_OK != res) {
+		SYSLOGERR("query failed[%d]: %s", res, sqlite3_errmsg(conn));
+		rc = P3AUTH_AUTH_ERR;
+		if (!sqlite3_get_autocommit(conn))
+			sqlite3_exec(conn, "ROLLBACK", NULL, NULL, NULL);
+	} else {
+		gen_bump(ctx, p3auth_user_hash(user));
+		replica_invalidate(ctx);
+	}
+
+done:
+	secret_free(query);
+	conn_put_writer(ctx, c);
+	secret_free(newpass_crypt);
+	return rc;
+}
@@ -0,0 +1,169 @@
+/*
+ * p3auth: the pam_sqlite3 authentication engine as a plain C library
+ *
+ * Everything pam_sqlite3.so does - option handling, SQL template
+ * compilation, password verification, account checks and password
+ * updates - is available here without a PAM stack or pam_handle_t.
+ *
+ * Usage: create a context with p3auth_new(), feed it options the same way
+ * the module gets them (config files and "name=value" strings), then call
+ * p3auth_prepare() once.  A prepared context is read-only and may be shared
+ * by any number of threads; all the calls that take one are reentrant.
+ * It keeps a few database connections open, with the compiled queries
+ * prepared on them, for reuse by later calls.
+ *
+ * This file is part of pam_sqlite3, see pam_sqlite3.c for copyright and
+ * licensing information.
+ */
+
+#ifndef P3AUTH_H
+#define P3AUTH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct p3auth_ctx p3auth_ctx;
+
+/* result codes, each maps onto the PAM code of the same name */
+enum {
+	P3AUTH_SUCCESS = 0,
+	P3AUTH_AUTH_ERR,			/* wrong password, or the lookup failed */
+	P3AUTH_USER_UNKNOWN,		/* no row for the user */
+	P3AUTH_ACCT_EXPIRED,		/* expired_column / sql_check_expired matched */
+	P3AUTH_NEW_AUTHTOK_REQD,	/* newtok_column / sql_check_newtok matched */
+	P3AUTH_AUTHINFO_UNAVAIL,	/* database could not be opened */
+	P3AUTH_BUF_ERR,				/* out of memory */
+	P3AUTH_PERM_DENIED,			/* sql_check_group / sql_check_host refused */
+	P3AUTH_AUTHTOK_ERR,			/* new password found in password_history */
+};
+
+/* create an empty context, NULL when out of memory */
+p3auth_ctx *p3auth_new(void);
+
+/*
+ * Name the service whose [service] sections config files should apply, as
+ * PAM_SERVICE does for the module.  Call before p3auth_load_config().
+ * Returns -1 when out of memory.
+ */
+int p3auth_set_service(p3auth_ctx *ctx, const char *service);
+
+/* set one option, as a "name=value" string or a bare flag such as "debug" */
+void p3auth_set_option(p3auth_ctx *ctx, const char *option);
+
+/* read options from a config file, -1 if it could not be opened */
+int p3auth_load_config(p3auth_ctx *ctx, const char *filename);
+
+/*
+ * Validate the options and compile the SQL templates.  Must be called
+ * once, after the last option is set and before any of the calls below.
+ * Returns 0 on success, -1 if required options are missing.
+ */
+int p3auth_prepare(p3auth_ctx *ctx);
+
+/* check a user's password */
+int p3auth_verify_password(p3auth_ctx *ctx, const char *user, const char *passwd);
+
+/*
+ * Split verification for callers that learn the user before the password,
+ * such as a PAM conversation.  p3auth_lookup_start() fetches the user's
+ * stored password on a helper thread, so the database work overlaps the
+ * wait for the password; p3auth_lookup_verify() then waits for it, checks
+ * the password and frees the lookup.  Abandon a lookup with
+ * p3auth_lookup_cancel().  If the verify query itself uses %P the lookup
+ * simply runs in p3auth_lookup_verify().
+ */
+typedef struct p3auth_lookup p3auth_lookup;
+
+p3auth_lookup *p3auth_lookup_start(p3auth_ctx *ctx, const char *user);
+int p3auth_lookup_verify(p3auth_lookup *lookup, const char *passwd);
+void p3auth_lookup_cancel(p3auth_lookup *lookup);
+
+/* check the user's account for expiry and forced password changes */
+int p3auth_check_account(p3auth_ctx *ctx, const char *user);
+
+/*
+ * Check the user is in one of allowed_groups (sql_check_group) and may log
+ * in from host (sql_check_host).  host may be NULL for local logins.
+ */
+int p3auth_check_access(p3auth_ctx *ctx, const char *user, const char *host);
+
+/*
+ * Hash a new password with pw_type and store it.  Returns
+ * P3AUTH_AUTHTOK_ERR if it is one of the last password_history passwords.
+ */
+int p3auth_set_password(p3auth_ctx *ctx, const char *user, const char *newpass);
+
+/*
+ * Start a session for user on tty, from host (either may be NULL).
+ * Returns P3AUTH_PERM_DENIED when the user already has max_sessions open
+ * on this host.  Otherwise the session is counted and, with session_table
+ * set, queued for writing there; pass *id to p3auth_close_session().
+ */
+int p3auth_open_session(p3auth_ctx *ctx, const char *user, const char *tty,
+	const char *host, unsigned long long *id);
+
+/* end a session started by p3auth_open_session() */
+void p3auth_close_session(p3auth_ctx *ctx, const char *user,
+	unsigned long long id);
+
+/*
+ * Open a database connection and prepare the compiled queries now, so the
+ * first call need not.  The connection stays open for later calls.
+ * Returns P3AUTH_AUTHINFO_UNAVAIL if the database cannot be opened.
+ */
+int p3auth_warm(p3auth_ctx *ctx);
+
+/*
+ * Close the connections not in use.  Call before fork() to leave children
+ * nothing to inherit: they open their own connections on first use.
+ */
+void p3auth_release_connections(p3auth_ctx *ctx);
+
+/* short description of a result code */
+const char *p3auth_strerror(int rc);
+
+void p3auth_free(p3auth_ctx *ctx);
+
+/*
+ * Asynchronous verification for event-driven servers.
+ *
+ * A pool runs p3auth_verify_password() on its own worker threads.  Submit
+ * requests with a cookie, wait for p3auth_pool_fd() to become readable
+ * (with epoll, poll or select), then collect finished requests with
+ * p3auth_poll().  Nothing here blocks on the database or on crypt().
+ */
+typedef struct p3auth_pool p3auth_pool;
+
+struct p3auth_completion {
+	void *cookie;		/* as passed to p3auth_submit_verify() */
+	int result;			/* P3AUTH_* code */
+};
+
+/*
+ * Start nthreads workers for a prepared context.  At most max_pending
+ * requests may be outstanding (submitted but not yet polled) at a time.
+ */
+p3auth_pool *p3auth_pool_new(p3auth_ctx *ctx, int nthreads, int max_pending);
+
+/* descriptor that is readable while completions are waiting */
+int p3auth_pool_fd(p3auth_pool *pool);
+
+/*
+ * Queue a password check.  user and passwd are copied.  Returns 0, or -1
+ * with errno set to EAGAIN when max_pending is reached or ENOMEM.
+ */
+int p3auth_submit_verify(p3auth_pool *pool, const char *user,
+	const char *passwd, void *cookie);
+
+/* collect up to max completions without blocking, returns how many */
+int p3auth_poll(p3auth_pool *pool, struct p3auth_completion *out, int max);
+
+/* stop the workers; requests not yet collected are dropped */
+void p3auth_pool_free(p3auth_pool *pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,214 @@
+/*
+ * Host-wide admission control for password hashing.
+ *
+ * Every process using the same admission_shm segment shares a fixed number
+ * of hashing slots (max_hash_concurrency).  A verification that finds no
+ * free slot queues for up to hash_queue_timeout milliseconds and is then
+ * shed, which the module reports as PAM_AUTHINFO_UNAVAIL.  Users who logged
+ * in successfully within recent_login_window seconds jump the queue: while
+ * any of them are waiting, everyone else keeps waiting.
+ *
+ * Slots record the holder's pid so that slots held by a process that died
+ * mid-hash are reclaimed by the next waiter.
+ *
+ * This file is part of pam_sqlite3, see pam_sqlite3.c for copyright and
+ * licensing information.
+ */
+
+#include "pam_sqlite3_int.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#define ADMIT_WAIT_SLICE	100		/* ms between checks for dead holders */
+
+static void
+admit_init(void *seg)
+{
+	struct p3auth_admit_shared *sh = seg;
+
+	p3auth_shm_mutex_init(&sh->lock);
+	p3auth_shm_cond_init(&sh->cond);
+}
+
+int
+admit_open(p3auth_ctx *ctx)
+{
+	struct module_options *options = ctx->options;
+	struct p3auth_admit_shared *sh;
+	int limit = options->max_hash_concurrency;
+
+	if (limit <= 0)
+		return 0;
+	if (limit > ADMIT_MAX_SLOTS)
+		limit = ADMIT_MAX_SLOTS;
+
+	if (!(sh = p3auth_shm_map(options->admission_shm ? options->admission_shm :
+			ADMIT_SHM_DEFAULT, sizeof(*sh), admit_init))) {
+		SYSLOGERR("admission control disabled");
+		return -1;
+	}
+	/* the most recently loaded configuration sets the limit */
+	__atomic_store_n(&sh->limit, limit, __ATOMIC_RELAXED);
+	ctx->admit = sh;
+	return 0;
+}
+
+void
+admit_close(p3auth_ctx *ctx)
+{
+	p3auth_shm_unmap(ctx->admit, sizeof(*ctx->admit));
+	ctx->admit = NULL;
+}
+
+static int
+is_recent(struct p3auth_admit_shared *sh, uint64_t user, int window)
+{
+	struct p3auth_admit_recent *r = &sh->recent[user % ADMIT_RECENT_SLOTS];
+
+	return window > 0 &&
+		__atomic_load_n(&r->user, __ATOMIC_RELAXED) == user &&
+		time(NULL) - (time_t)__atomic_load_n(&r->when, __ATOMIC_RELAXED) < window;
+}
+
+/* free slots whose holders no longer exist */
+static void
+reclaim_dead(struct p3auth_admit_shared *sh)
+{
+	int i;
+
+	for (i = 0; i < ADMIT_MAX_SLOTS; i++) {
+		pid_t pid = sh->holders[i];
+
+		if (pid && kill(pid, 0) != 0 && errno == ESRCH) {
+			sh->holders[i] = 0;
+			sh->inflight--;
+		}
+	}
+}
+
+/* take a slot if policy allows, returns it or -1 */
+static int
+try_take(struct p3auth_admit_shared *sh, int priority)
+{
+	int i;
+
+	if (sh->inflight >= sh->limit || (!priority && sh->waiting_priority))
+		return -1;
+	for (i = 0; i < ADMIT_MAX_SLOTS; i++) {
+		if (!sh->holders[i]) {
+			sh->holders[i] = getpid();
+			sh->inflight++;
+			sh->admitted++;
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Wait for a hashing slot.  Returns the slot to hand back to admit_leave(),
+ * ADMIT_UNLIMITED when admission control is off, or -1 if the request was
+ * shed.
+ */
+int
+admit_enter(p3auth_ctx *ctx, uint64_t user)
+{
+	struct module_options *options = ctx->options;
+	struct p3auth_admit_shared *sh = ctx->admit;
+	struct timespec deadline, slice;
+	int priority, slot;
+
+	if (!sh)
+		return ADMIT_UNLIMITED;
+
+	priority = is_recent(sh, user, options->recent_login_window);
+
+	if (p3auth_shm_lock(&sh->lock) != 0)
+		return ADMIT_UNLIMITED;
+
+	if ((slot = try_take(sh, priority)) < 0) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += options->hash_queue_timeout / 1000;
+		deadline.tv_nsec += (options->hash_queue_timeout % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+
+		sh->waiting++;
+		if (priority)
+			sh->waiting_priority++;
+
+		for (;;) {
+			clock_gettime(CLOCK_REALTIME, &slice);
+			slice.tv_nsec += ADMIT_WAIT_SLICE * 1000000L;
+			if (slice.tv_nsec >= 1000000000L) {
+				slice.tv_sec++;
+				slice.tv_nsec -= 1000000000L;
+			}
+			if (slice.tv_sec > deadline.tv_sec ||
+					(slice.tv_sec == deadline.tv_sec && slice.tv_nsec > deadline.tv_nsec))
+				slice = deadline;
+
+			if (pthread_cond_timedwait(&sh->cond, &sh->lock, &slice) == EOWNERDEAD)
+				pthread_mutex_consistent(&sh->lock);
+
+			reclaim_dead(sh);
+			if ((slot = try_take(sh, priority)) >= 0)
+				break;
+			if (slice.tv_sec == deadline.tv_sec && slice.tv_nsec == deadline.tv_nsec)
+				break;
+		}
+
+		sh->waiting--;
+		if (priority)
+			sh->waiting_priority--;
+		if (slot < 0)
+			sh->shed++;
+		else
+			sh->queued++;
+	}
+	pthread_mutex_unlock(&sh->lock);
+
+	if (slot < 0)
+		SYSLOG("too many concurrent logins, shedding request");
+	return slot;
+}
+
+void
+admit_leave(p3auth_ctx *ctx, int slot)
+{
+	struct p3auth_admit_shared *sh = ctx->admit;
+
+	if (!sh || slot < 0)
+		return;
+
+	if (p3auth_shm_lock(&sh->lock) != 0)
+		return;
+	if (sh->holders[slot]) {
+		sh->holders[slot] = 0;
+		sh->inflight--;
+	}
+	/* wake everyone: priority waiters must get a look in first */
+	pthread_cond_broadcast(&sh->cond);
+	pthread_mutex_unlock(&sh->lock);
+}
+
+/* remember a successful login, giving the user priority for a while */
+void
+admit_success(p3auth_ctx *ctx, uint64_t user)
+{
+	struct p3auth_admit_recent *r;
+
+	if (!ctx->admit)
+		return;
+	r = &ctx->admit->recent[user % ADMIT_RECENT_SLOTS];
+	__atomic_store_n(&r->user, user, __ATOMIC_RELAXED);
+	__atomic_store_n(&r->when, (uint64_t)time(NULL), __ATOMIC_RELAXED);
+}
@@ -0,0 +1,273 @@
+/*
+ * p3auth asynchronous verification, see p3auth.h
+ *
+ * Requests go onto a bounded FIFO served by a fixed set of worker threads,
+ * each of which runs the ordinary blocking p3auth_verify_password().
+ * Finished requests move to a completion list and the pool's eventfd is
+ * bumped, so an event loop can wait for it alongside its sockets and then
+ * drain the results with p3auth_poll().
+ *
+ * This file is part of pam_sqlite3, see pam_sqlite3.c for copyright and
+ * licensing information.
+ */
+
+#include "pam_sqlite3_int.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <pthread.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#if HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
+struct request {
+	struct request *next;
+	char *user;
+	char *passwd;
+	void *cookie;
+	int result;
+};
+
+struct p3auth_pool {
+	p3auth_ctx *ctx;
+	int nthreads;
+	pthread_t *threads;
+
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	struct request *queue, **queue_tail;	/* waiting for a worker */
+	struct request *done, **done_tail;		/* waiting for p3auth_poll() */
+	int outstanding;						/* submitted but not yet polled */
+	int max_pending;
+	int stop;
+
+	int fd;			/* eventfd, or the read end of the pipe */
+	int wfd;		/* write end of the pipe, or fd again */
+};
+
+static void
+free_request(struct request *req)
+{
+	free(req->user);
+	secret_free(req->passwd);
+	free(req);
+}
+
+/* tell the event loop there is something to collect */
+static void
+notify(p3auth_pool *pool)
+{
+	uint64_t one = 1;
+	ssize_t res;
+
+	do {
+		res = write(pool->wfd, &one, pool->wfd == pool->fd ? sizeof(one) : 1);
+	} while (res < 0 && errno == EINTR);
+	/* EAGAIN just means the loop already has a wakeup pending */
+}
+
+/* reset the readiness of the notification fd */
+static void
+drain(p3auth_pool *pool)
+{
+	char buf[64];
+
+	while (read(pool->fd, buf, sizeof(buf)) > 0 && pool->fd != pool->wfd)
+		;
+}
+
+static void *
+worker(void *arg)
+{
+	p3auth_pool *pool = arg;
+	struct request *req;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->stop && !pool->queue)
+			pthread_cond_wait(&pool->work, &pool->lock);
+		if (pool->stop)
+			break;
+
+		req = pool->queue;
+		if (!(pool->queue = req->next))
+			pool->queue_tail = &pool->queue;
+		pthread_mutex_unlock(&pool->lock);
+
+		req->result = p3auth_verify_password(pool->ctx, req->user, req->passwd);
+		secret_free(req->passwd);
+		req->passwd = NULL;
+
+		pthread_mutex_lock(&pool->lock);
+		req->next = NULL;
+		*pool->done_tail = req;
+		pool->done_tail = &req->next;
+		notify(pool);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+static int
+open_notify_fd(p3auth_pool *pool)
+{
+#if HAVE_SYS_EVENTFD_H
+	if ((pool->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) >= 0) {
+		pool->wfd = pool->fd;
+		return 0;
+	}
+#endif
+	{
+		int fds[2], i;
+
+		if (pipe(fds) != 0)
+			return -1;
+		for (i = 0; i < 2; i++) {
+			fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+			fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+		}
+		pool->fd = fds[0];
+		pool->wfd = fds[1];
+	}
+	return 0;
+}
+
+p3auth_pool *
+p3auth_pool_new(p3auth_ctx *ctx, int nthreads, int max_pending)
+{
+	p3auth_pool *pool;
+	int i;
+
+	if (nthreads <= 0 || max_pending <= 0)
+		return NULL;
+	if (!(pool = calloc(1, sizeof(*pool))))
+		return NULL;
+	if (!(pool->threads = calloc(nthreads, sizeof(*pool->threads))) ||
+			open_notify_fd(pool) != 0) {
+		free(pool->threads);
+		free(pool);
+		return NULL;
+	}
+
+	pool->ctx = ctx;
+	pool->max_pending = max_pending;
+	pool->queue_tail = &pool->queue;
+	pool->done_tail = &pool->done;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&pool->threads[i], NULL, worker, pool) != 0)
+			break;
+		pool->nthreads++;
+	}
+	if (!pool->nthreads) {
+		p3auth_pool_free(pool);
+		return NULL;
+	}
+	return pool;
+}
+
+int
+p3auth_pool_fd(p3auth_pool *pool)
+{
+	return pool->fd;
+}
+
+int
+p3auth_submit_verify(p3auth_pool *pool, const char *user, const char *passwd,
+	void *cookie)
+{
+	struct request *req;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->outstanding >= pool->max_pending) {
+		pthread_mutex_unlock(&pool->lock);
+		errno = EAGAIN;
+		return -1;
+	}
+	pool->outstanding++;
+	pthread_mutex_unlock(&pool->lock);
+
+	if (!(req = calloc(1, sizeof(*req))) ||
+			!(req->user = strdup(user)) || !(req->passwd = secret_strdup(passwd))) {
+		if (req)
+			free_request(req);
+		pthread_mutex_lock(&pool->lock);
+		pool->outstanding--;
+		pthread_mutex_unlock(&pool->lock);
+		errno = ENOMEM;
+		return -1;
+	}
+	req->cookie = cookie;
+
+	pthread_mutex_lock(&pool->lock);
+	*pool->queue_tail = req;
+	pool->queue_tail = &req->next;
+	pthread_cond_signal(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	return 0;
+}
+
+int
+p3auth_poll(p3auth_pool *pool, struct p3auth_completion *out, int max)
+{
+	struct request *req;
+	int n = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	/* reset the fd first, so a completion racing with us re-arms it */
+	drain(pool);
+	while (n < max && (req = pool->done)) {
+		if (!(pool->done = req->next))
+			pool->done_tail = &pool->done;
+		out[n].cookie = req->cookie;
+		out[n].result = req->result;
+		free_request(req);
+		n++;
+	}
+	pool->outstanding -= n;
+	/* anything left over still needs the loop to come back */
+	if (pool->done)
+		notify(pool);
+	pthread_mutex_unlock(&pool->lock);
+	return n;
+}
+
+void
+p3auth_pool_free(p3auth_pool *pool)
+{
+	struct request *req;
+	int i;
+
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 0; i < pool->nthreads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	while ((req = pool->queue)) {
+		pool->queue = req->next;
+		free_request(req);
+	}
+	while ((req = pool->done)) {
+		pool->done = req->next;
+		free_request(req);
+	}
+	close(pool->fd);
+	if (pool->wfd != pool->fd)
+		close(pool->wfd);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->work);
+	free(pool->threads);
+	free(pool);
+}
@@ -0,0 +1,318 @@
+/*
+ * Audit trail: one row per PAM call in audit_table.
+ *
+ * Callers only copy the record into an in-memory ring buffer.  A flusher
+ * thread, started on first use, writes the ring out in one transaction
+ * whenever audit_batch records are waiting or audit_flush_ms has passed,
+ * using an INSERT prepared with audit_batch rows of parameters, so the
+ * cost of an fsync is shared by a whole batch of logins.  When the ring is
+ * full new records are counted and dropped rather than blocking a login.
+ *
+ * This file is part of pam_sqlite3, see pam_sqlite3.c for copyright and
+ * licensing information.
+ */
+
+#include "pam_sqlite3_int.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#define AUDIT_MAX_BATCH		128		/* 6 parameters a row, under SQLite's 999 */
+#define AUDIT_MIN_RING		256
+#define AUDIT_BUSY_TIMEOUT	5000	/* ms */
+#define AUDIT_COLUMNS		"time, user, service, op, result, usec"
+#define AUDIT_NCOLUMNS		6
+
+struct audit_entry {
+	time_t when;
+	char user[AUDIT_USER_MAX];
+	char service[AUDIT_SERVICE_MAX];
+	const char *op;			/* a string literal */
+	int result;
+	uint32_t usec;
+};
+
+struct p3auth_audit {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct audit_entry *ring;
+	struct audit_entry *scratch;	/* the flusher's copy of a batch */
+	unsigned cap, head, count;
+	uint64_t dropped;
+	int batch;
+	int flush_ms;
+	int started, stop;
+	pid_t pid;
+	pthread_t thread;
+
+	/* used only by the flusher thread */
+	sqlite3 *db;
+	sqlite3_stmt *insert_batch;
+	sqlite3_stmt *insert_one;
+};
+
+static sqlite3_stmt *
+audit_prepare_insert(sqlite3 *db, const char *table, int rows)
+{
+	sqlite3_stmt *vm = NULL;
+	size_t len = strlen(table) + 64 + rows * 16;
+	char *sql, *p;
+	int i;
+
+	if (!(sql = malloc(len)))
+		return NULL;
+	p = sql + snprintf(sql, len, "INSERT INTO %s (" AUDIT_COLUMNS ") VALUES ", table);
+	for (i = 0; i < rows; i++)
+		p += sprintf(p, "%s(?,?,?,?,?,?)", i ? "," : "");
+	sqlite3_prepare_v2(db, sql, -1, &vm, NULL);
+	free(sql);
+	return vm;
+}
+
+/* open the audit database and prepare the inserts, in the flusher thread */
+static int
+audit_connect(p3auth_ctx *ctx)
+{
+	struct module_options *options = ctx->options;
+	struct p3auth_audit *a = ctx->audit;
+	const char *path = options->audit_database ? options->audit_database :
+		options->database;
+	char *sql;
+
+	if (sqlite3_open_v2(path, &a->db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+			NULL) != SQLITE_OK)
+		goto fail;
+	sqlite3_busy_timeout(a->db, AUDIT_BUSY_TIMEOUT);
+
+	if (!(sql = sqlite3_mprintf("CREATE TABLE IF NOT EXISTS %s (time INTEGER, "
+			"user TEXT, service TEXT, op TEXT, result INTEGER, usec INTEGER)",
+			options->audit_table)))
+		goto fail;
+	sqlite3_exec(a->db, sql, NULL, NULL, NULL);
+	sqlite3_free(sql);
+
+	if (!(a->insert_batch = audit_prepare_insert(a->db, options->audit_table, a->batch)) ||
+			!(a->insert_one = audit_prepare_insert(a->db, options->audit_table, 1)))
+		goto fail;
+	return 0;
+
+fail:
+	SYSLOGERR("audit database %s unusable: %s", path, sqlite3_errmsg(a->db));
+	sqlite3_finalize(a->insert_batch);
+	sqlite3_finalize(a->insert_one);
+	sqlite3_close(a->db);
+	a->db = NULL;
+	a->insert_batch = a->insert_one = NULL;
+	return -1;
+}
+
+static void
+audit_bind(sqlite3_stmt *vm, int row, const struct audit_entry *e)
+{
+	int col = row * AUDIT_NCOLUMNS;
+
+	sqlite3_bind_int64(vm, col + 1, (sqlite3_int64)e->when);
+	sqlite3_bind_text(vm, col + 2, e->user, -1, SQLITE_STATIC);
+	sqlite3_bind_text(vm, col + 3, e->service, -1, SQLITE_STATIC);
+	sqlite3_bind_text(vm, col + 4, e->op, -1, SQLITE_STATIC);
+	sqlite3_bind_int(vm, col + 5, e->result);
+	sqlite3_bind_int64(vm, col + 6, e->usec);
+}
+
+static int
+audit_step(sqlite3_stmt *vm)
+{
+	int res = sqlite3_step(vm);
+
+	sqlite3_reset(vm);
+	sqlite3_clear_bindings(vm);
+	return res == SQLITE_DONE ? 0 : -1;
+}
+
+/* write n records in one transaction, full batches first */
+static void
+audit_write(p3auth_ctx *ctx, struct audit_entry *e, unsigned n)
+{
+	struct p3auth_audit *a = ctx->audit;
+	unsigned i = 0;
+	int row, err = 0;
+
+	if (!a->db && audit_connect(ctx) != 0)
+		return;
+
+	if (sqlite3_exec(a->db, "BEGIN", NULL, NULL, NULL) != SQLITE_OK)
+		err = 1;
+	for (; !err && n - i >= (unsigned)a->batch; i += a->batch) {
+		for (row = 0; row < a->batch; row++)
+			audit_bind(a->insert_batch, row, &e[i + row]);
+		err = audit_step(a->insert_batch);
+	}
+	for (; !err && i < n; i++) {
+		audit_bind(a->insert_one, 0, &e[i]);
+		err = audit_step(a->insert_one);
+	}
+	if (err || sqlite3_exec(a->db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+		SYSLOGERR("audit records lost: %s", sqlite3_errmsg(a->db));
+		sqlite3_exec(a->db, "ROLLBACK", NULL, NULL, NULL);
+	}
+}
+
+static void *
+audit_thread(void *arg)
+{
+	p3auth_ctx *ctx = arg;
+	struct p3auth_audit *a = ctx->audit;
+	struct timespec deadline;
+	unsigned n, i;
+
+	pthread_mutex_lock(&a->lock);
+	for (;;) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += a->flush_ms / 1000;
+		deadline.tv_nsec += (a->flush_ms % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		while (!a->stop && a->count < (unsigned)a->batch)
+			if (pthread_cond_timedwait(&a->cond, &a->lock, &deadline) == ETIMEDOUT)
+				break;
+
+		if (a->dropped) {
+			SYSLOGERR("audit ring full, %llu records dropped",
+				(unsigned long long)a->dropped);
+			a->dropped = 0;
+		}
+		if ((n = a->count)) {
+			for (i = 0; i < n; i++)
+				a->scratch[i] = a->ring[(a->head + i) % a->cap];
+			a->head = (a->head + n) % a->cap;
+			a->count = 0;
+			pthread_mutex_unlock(&a->lock);
+			audit_write(ctx, a->scratch, n);
+			pthread_mutex_lock(&a->lock);
+		}
+		if (a->stop && !a->count)
+			break;
+	}
+	pthread_mutex_unlock(&a->lock);
+	return NULL;
+}
+
+int
+trail_open(p3auth_ctx *ctx)
+{
+	struct module_options *options = ctx->options;
+	struct p3auth_audit *a;
+
+	if (!options->audit_table)
+		return 0;
+	if (!(a = calloc(1, sizeof(*a))))
+		return -1;
+
+	a->batch = options->audit_batch;
+	if (a->batch <= 0)
+		a->batch = 1;
+	if (a->batch > AUDIT_MAX_BATCH)
+		a->batch = AUDIT_MAX_BATCH;
+	a->flush_ms = options->audit_flush_ms > 0 ? options->audit_flush_ms : 1;
+	a->cap = a->batch * 4 < AUDIT_MIN_RING ? AUDIT_MIN_RING : a->batch * 4;
+	if (!(a->ring = calloc(a->cap, sizeof(*a->ring))) ||
+			!(a->scratch = calloc(a->cap, sizeof(*a->scratch)))) {
+		free(a->ring);
+		free(a);
+		return -1;
+	}
+	pthread_mutex_init(&a->lock, NULL);
+	pthread_cond_init(&a->cond, NULL);
+	a->pid = getpid();
+	ctx->audit = a;
+	return 0;
+}
+
+/* flush what is queued and stop the flusher */
+void
+trail_close(p3auth_ctx *ctx)
+{
+	struct p3auth_audit *a = ctx->audit;
+
+	if (!a)
+		return;
+
+	if (a->pid == getpid()) {
+		pthread_mutex_lock(&a->lock);
+		a->stop = 1;
+		pthread_cond_signal(&a->cond);
+		pthread_mutex_unlock(&a->lock);
+		if (a->started)
+			pthread_join(a->thread, NULL);
+		else if (a->count)
+			audit_thread(ctx);		/* never started: flush inline */
+		sqlite3_finalize(a->insert_batch);
+		sqlite3_finalize(a->insert_one);
+		sqlite3_close(a->db);
+		pthread_mutex_destroy(&a->lock);
+		pthread_cond_destroy(&a->cond);
+	}
+	free(a->ring);
+	free(a->scratch);
+	free(a);
+	ctx->audit = NULL;
+}
+
+/*
+ * A forked child inherits the parent's queue, which the parent will
+ * write, but not its flusher thread or a usable lock: start afresh.
+ */
+static void
+audit_after_fork(struct p3auth_audit *a)
+{
+	pthread_mutex_init(&a->lock, NULL);
+	pthread_cond_init(&a->cond, NULL);
+	a->head = a->count = 0;
+	a->dropped = 0;
+	a->started = a->stop = 0;
+	a->db = NULL;
+	a->insert_batch = a->insert_one = NULL;
+	a->pid = getpid();
+}
+
+/* queue a record of one call; never blocks on the database */
+void
+trail_record(p3auth_ctx *ctx, const char *op, const char *user, int result,
+	uint64_t usec)
+{
+	struct p3auth_audit *a = ctx ? ctx->audit : NULL;
+	struct audit_entry *e;
+	const char *service = ctx ? ctx->options->service : NULL;
+
+	if (!a)
+		return;
+	if (a->pid != getpid())
+		audit_after_fork(a);
+
+	pthread_mutex_lock(&a->lock);
+	if (!a->started && !a->stop) {
+		if (pthread_create(&a->thread, NULL, audit_thread, ctx) == 0)
+			a->started = 1;
+	}
+	if (a->count == a->cap) {
+		a->dropped++;
+	} else {
+		e = &a->ring[(a->head + a->count++) % a->cap];
+		e->when = time(NULL);
+		snprintf(e->user, sizeof(e->user), "%s", user ? user : "");
+		snprintf(e->service, sizeof(e->service), "%s", service ? service : "");
+		e->op = op;
+		e->result = result;
+		e->usec = usec > UINT32_MAX ? UINT32_MAX : (uint32_t)usec;
+		if (a->count >= (unsigned)a->batch)
+			pthread_cond_signal(&a->cond);
+	}
+	pthread_mutex_unlock(&a->lock);
+}
@@ -0,0 +1,153 @@
+/*
+ * Per-user invalidation feed for the caches of every process on the host.
+ *
+ * A shared segment holds a table of generation counters indexed by user
+ * hash.  Whoever changes a user's record bumps that user's counter; a cache
+ * remembers the counter it saw when it looked the user up and treats the
+ * entry as stale once the counter has moved, which costs one atomic load.
+ * Users sharing a slot invalidate each other, which is harmless.
+ *
+ * Changes made behind the module's back (sqlite3 shell, provisioning
+ * scripts) are picked up from changelog_table, which triggers installed by
+ * "pam_sqlite3-admin changelog" fill with the names of changed users.  At
+ * most one process polls it every changelog_poll_ms and bumps the users it
+ * finds there on behalf of everyone else.
+ *
+ * This file is part of pam_sqlite3, see pam_sqlite3.c for copyright and
+ * licensing information.
+ */
+
+#include "pam_sqlite3_int.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static uint64_t
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int
+gen_open(p3auth_ctx *ctx)
+{
+	struct module_options *options = ctx->options;
+
+	if (!(ctx->gen = p3auth_shm_map(options->generation_shm ?
+			options->generation_shm : GEN_SHM_DEFAULT, sizeof(*ctx->gen), NULL))) {
+		SYSLOGERR("cache invalidation across processes disabled");
+		return -1;
+	}
+	return 0;
+}
+
+void
+gen_close(p3auth_ctx *ctx)
+{
+	p3auth_shm_unmap(ctx->gen, sizeof(*ctx->gen));
+	ctx->gen = NULL;
+}
+
+/* the generation a cache entry for this user must carry to be current */
+uint32_t
+gen_current(p3auth_ctx *ctx, uint64_t user)
+{
+	if (!ctx->gen)
+		return 0;
+	return __atomic_load_n(&ctx->gen->gen[user % GEN_SLOTS], __ATOMIC_ACQUIRE);
+}
+
+/* invalidate every cached entry for this user, in every process */
+void
+gen_bump(p3auth_ctx *ctx, uint64_t user)
+{
+	if (ctx->gen)
+		__atomic_add_fetch(&ctx->gen->gen[user % GEN_SLOTS], 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * count a use of the database, so "pam_sqlite3-admin maintain" can tell
+ * when the host is quiet
+ */
+void
+gen_note_use(p3auth_ctx *ctx)
+{
+	if (ctx->gen)
+		__atomic_add_fetch(&ctx->gen->uses, 1, __ATOMIC_RELAXED);
+}
+
+/* bump the users logged after id *seen, advancing it */
+static int
+gen_apply(p3auth_ctx *ctx, sqlite3 *db, int64_t *seen)
+{
+	struct module_options *options = ctx->options;
+	sqlite3_stmt *vm = NULL;
+	const char *user;
+	char *sql;
+	int res;
+
+	if (*seen)
+		sql = sqlite3_mprintf("SELECT id, user FROM \"%w\" WHERE id > ?1 ORDER BY id",
+			options->changelog_table);
+	else	/* first poll on this host: nothing older can be cached */
+		sql = sqlite3_mprintf("SELECT coalesce(max(id), 0), NULL FROM \"%w\"",
+			options->changelog_table);
+	if (!sql)
+		return -1;
+	res = sqlite3_prepare_v2(db, sql, -1, &vm, NULL);
+	sqlite3_free(sql);
+	if (res != SQLITE_OK) {
+		SYSLOGERR("cannot read %s: %s", options->changelog_table,
+			sqlite3_errmsg(db));
+		return -1;
+	}
+	sqlite3_bind_int64(vm, 1, *seen);
+	while ((res = stmt_step(vm, "changelog")) == SQLITE_ROW) {
+		if ((user = (const char *)sqlite3_column_text(vm, 1)))
+			gen_bump(ctx, p3auth_user_hash(user));
+		*seen = sqlite3_column_int64(vm, 0);
+	}
+	if (res != SQLITE_DONE)
+		SYSLOGERR("cannot read %s: %s", options->changelog_table,
+			sqlite3_errmsg(db));
+	sqlite3_finalize(vm);
+	return res == SQLITE_DONE ? 0 : -1;
+}
+
+/*
+ * Apply changes logged in changelog_table if nobody on the host has done
+ * so for changelog_poll_ms.  Called before consulting a cache.
+ */
+void
+gen_poll(p3auth_ctx *ctx)
+{
+	struct p3auth_gen_shared *sh = ctx->gen;
+	struct p3auth_conn *c;
+	uint64_t now, last, seen;
+	int64_t next;
+
+	if (!sh || !ctx->options->changelog_table)
+		return;
+	now = now_ms();
+	last = __atomic_load_n(&sh->polled, __ATOMIC_RELAXED);
+	if (now - last < (uint64_t)ctx->options->changelog_poll_ms && last)
+		return;
+	/* the process that moves the stamp does the poll */
+	if (!__atomic_compare_exchange_n(&sh->polled, &last, now, 0,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		return;
+
+	if (!(c = conn_get(ctx)))
+		return;
+	seen = __atomic_load_n(&sh->seen, __ATOMIC_ACQUIRE);
+	next = seen;
+	if (gen_apply(ctx, c->db, &next) == 0)
+		/* a slower poller that started earlier must not move it back */
+		while (seen < (uint64_t)next && !__atomic_compare_exchange_n(&sh->seen,
+				&seen, next, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+			;
+	conn_put(ctx, c);
+}
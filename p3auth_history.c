@@ -0,0 +1,224 @@
+/*
+ * Password history: the hashes of the last password_history passwords set
+ * through the module, kept in history_table, which a new password must
+ * match none of.
+ *
+ * Each comparison costs a full crypt(), so the candidate is checked
+ * against the stored hashes on up to one thread per CPU at once, and the
+ * threads stop taking hashes as soon as one of them matches.  The caller
+ * records the new hash, and drops those beyond the depth, in the
+ * transaction that stores the password.
+ *
+ * This file is part of pam_sqlite3, see pam_sqlite3.c for copyright and
+ * licensing information.
+ */
+
+#include "pam_sqlite3_int.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#define HISTORY_THREADS_MAX	8
+
+static const char *
+history_table(struct module_options *options)
+{
+	return options->history_table ? options->history_table : HISTORY_TABLE_DEFAULT;
+}
+
+/* one password checked against a user's history */
+struct history_job {
+	struct module_options *options;
+	const char *pass;
+	char **hashes;
+	int n;
+	int next;		/* next hash to take */
+	int found;		/* a hash matched, stop taking more */
+	int failed;		/* a hash could not be computed */
+};
+
+static void *
+history_worker(void *arg)
+{
+	struct history_job *job = arg;
+	struct crypt_data *data = NULL;
+	int i, match;
+
+	if (job->options->pw_type != PW_CLEAR &&
+			!(data = secret_alloc(sizeof(*data)))) {
+		__atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	while (!__atomic_load_n(&job->found, __ATOMIC_RELAXED) &&
+			(i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->n) {
+		if ((match = password_matches(job->options, job->pass, job->hashes[i],
+				data)) == 1)
+			__atomic_store_n(&job->found, 1, __ATOMIC_RELAXED);
+		else if (match < 0)
+			__atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+	}
+	secret_free(data);
+	return NULL;
+}
+
+/* the hashes on record for user, newest first, from the secret pool */
+static int
+history_read(p3auth_ctx *ctx, sqlite3 *db, const char *user, char ***hashes)
+{
+	struct module_options *options = ctx->options;
+	const char *table = history_table(options);
+	sqlite3_stmt *vm = NULL;
+	const char *hash;
+	char *sql;
+	int n = 0, res;
+
+	*hashes = NULL;
+	if (!(sql = sqlite3_mprintf("SELECT hash FROM \"%w\" WHERE user = ?1 "
+			"ORDER BY id DESC LIMIT ?2", table)))
+		return -1;
+	res = sqlite3_prepare_v2(db, sql, -1, &vm, NULL);
+	sqlite3_free(sql);
+	if (res != SQLITE_OK) {
+		SYSLOGERR("cannot read %s: %s", table, sqlite3_errmsg(db));
+		return -1;
+	}
+	if (!(*hashes = calloc(options->password_history, sizeof(**hashes)))) {
+		sqlite3_finalize(vm);
+		return -1;
+	}
+	sqlite3_bind_text(vm, 1, user, -1, SQLITE_STATIC);
+	sqlite3_bind_int(vm, 2, options->password_history);
+	while (n < options->password_history && (res = stmt_step(vm, "history")) == SQLITE_ROW) {
+		if (!(hash = (const char *)sqlite3_column_text(vm, 0)))
+			continue;
+		if (!((*hashes)[n] = secret_strdup(hash))) {
+			res = SQLITE_NOMEM;
+			break;
+		}
+		n++;
+	}
+	if (res != SQLITE_ROW && res != SQLITE_DONE) {
+		SYSLOGERR("cannot read %s: %s", table, sqlite3_errmsg(db));
+		while (n > 0)
+			secret_free((*hashes)[--n]);
+		n = -1;
+	}
+	sqlite3_finalize(vm);
+	return n;
+}
+
+/*
+ * Is pass one of user's last password_history passwords?  Returns 1 if
+ * so, 0 if not, -1 if the history could not be checked.
+ */
+int
+history_check(p3auth_ctx *ctx, sqlite3 *db, const char *user, const char *pass)
+{
+	struct module_options *options = ctx->options;
+	struct history_job job;
+	pthread_t threads[HISTORY_THREADS_MAX];
+	char **hashes;
+	long cpus;
+	int n, i, nthreads = 0;
+
+	if ((n = history_read(ctx, db, user, &hashes)) <= 0) {
+		free(hashes);
+		return n;
+	}
+	memset(&job, 0, sizeof(job));
+	job.options = options;
+	job.pass = pass;
+	job.hashes = hashes;
+	job.n = n;
+
+	/* this thread takes a share as well */
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (options->pw_type != PW_CLEAR)
+		while (nthreads + 1 < n && nthreads + 1 < cpus &&
+				nthreads < HISTORY_THREADS_MAX &&
+				pthread_create(&threads[nthreads], NULL, history_worker, &job) == 0)
+			nthreads++;
+	history_worker(&job);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	for (i = 0; i < n; i++)
+		secret_free(hashes[i]);
+	free(hashes);
+	if (job.found)
+		return 1;
+	return job.failed ? -1 : 0;
+}
+
+/* run one statement of history_record() */
+static int
+history_step(sqlite3 *db, char *sql, const char *user, const char *hash,
+	int depth)
+{
+	sqlite3_stmt *vm = NULL;
+	int res;
+
+	if (!sql)
+		return SQLITE_NOMEM;
+	res = sqlite3_prepare_v2(db, sql, -1, &vm, NULL);
+	sqlite3_free(sql);
+	if (res != SQLITE_OK)
+		return res;
+	sqlite3_bind_text(vm, 1, user, -1, SQLITE_STATIC);
+	if (hash) {
+		sqlite3_bind_text(vm, 2, hash, -1, SQLITE_STATIC);
+		sqlite3_bind_int64(vm, 3, (sqlite3_int64)time(NULL));
+	} else {
+		sqlite3_bind_int(vm, 2, depth);
+	}
+	res = stmt_step(vm, "history");
+	sqlite3_finalize(vm);
+	return res == SQLITE_DONE ? SQLITE_OK : res;
+}
+
+/*
+ * Add hash to user's history and forget those beyond password_history.
+ * Runs inside the caller's transaction.
+ */
+int
+history_record(p3auth_ctx *ctx, sqlite3 *db, const char *user, const char *hash)
+{
+	struct module_options *options = ctx->options;
+	const char *table = history_table(options);
+	int res;
+
+	res = history_step(db, sqlite3_mprintf("INSERT INTO \"%w\" (user, hash, "
+		"changed) VALUES (?1, ?2, ?3)", table), user, hash, 0);
+	if (res == SQLITE_OK)
+		res = history_step(db, sqlite3_mprintf("DELETE FROM \"%w\" WHERE "
+			"user = ?1 AND id <= (SELECT id FROM \"%w\" WHERE user = ?1 "
+			"ORDER BY id DESC LIMIT 1 OFFSET ?2)", table, table), user, NULL,
+			options->password_history);
+	if (res != SQLITE_OK)
+		SYSLOGERR("cannot update %s: %s", table, sqlite3_errmsg(db));
+	return res;
+}
+
+/* create history_table where it is missing */
+int
+history_create(p3auth_ctx *ctx, sqlite3 *db)
+{
+	struct module_options *options = ctx->options;
+	const char *table = history_table(options);
+	char *sql;
+	int res;
+
+	if (!(sql = sqlite3_mprintf("CREATE TABLE IF NOT EXISTS \"%w\" (id INTEGER "
+			"PRIMARY KEY AUTOINCREMENT, user TEXT NOT NULL, hash TEXT NOT NULL, "
+			"changed INTEGER); CREATE INDEX IF NOT EXISTS \"%w_user\" ON \"%w\" "
+			"(user, id)", table, table, table)))
+		return SQLITE_NOMEM;
+	if ((res = sqlite3_exec(db, sql, NULL, NULL, NULL)) != SQLITE_OK)
+		SYSLOGERR("cannot create %s: %s", table, sqlite3_errmsg(db));
+	sqlite3_free(sql);
+	return res;
+}
@@ -0,0 +1,197 @@
+/*
+ * Read replica: a copy of the database on fast local storage, typically
+ * tmpfs, that every read-only connection uses instead of the primary.
+ *
+ * The replica is refreshed with the online backup API into a temporary
+ * file beside it, which is then renamed into place; connections notice
+ * the new inode and reopen (see conn_check()).  As a replica is never
+ * changed in place, readers open it immutable and skip SQLite's file
+ * locking and change detection altogether.  It is considered current
+ * for replica_refresh_ms after its mtime.  Once that has passed, the
+ * first caller to take the lock on "<replica>.lock" compares the
+ * primary's signature (mtime and size of the database and its -wal file,
+ * the cross-process stand-in for PRAGMA data_version) with the one
+ * recorded in the lock file: if nothing changed it only touches the
+ * replica, otherwise it copies the database again.  Everyone else keeps
+ * reading the replica they have meanwhile.
+ *
+ * Writes always go to the primary.  A password change marks the replica
+ * stale so the next read refreshes it.
+ *
+ * This file is part of pam_sqlite3, see pam_sqlite3.c for copyright and
+ * licensing information.
+ */
+
+#include "pam_sqlite3_int.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#define REPLICA_STEP_PAGES	256		/* copied per backup step */
+#define REPLICA_SIG_MAX		128
+
+/* has the replica been checked within replica_refresh_ms? */
+static int
+replica_fresh(p3auth_ctx *ctx, const struct stat *st)
+{
+	struct timespec now;
+	long long age;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	age = (long long)(now.tv_sec - st->st_mtim.tv_sec) * 1000 +
+		(now.tv_nsec - st->st_mtim.tv_nsec) / 1000000;
+	return age >= 0 && age < ctx->options->replica_refresh_ms;
+}
+
+/* what changes when anyone commits to the primary */
+static void
+replica_signature(const char *database, char *sig, size_t len)
+{
+	char wal[PATH_MAX];
+	struct stat db, log;
+
+	memset(&db, 0, sizeof(db));
+	memset(&log, 0, sizeof(log));
+	stat(database, &db);
+	snprintf(wal, sizeof(wal), "%s-wal", database);
+	stat(wal, &log);
+	snprintf(sig, len, "%lld.%09ld %lld %lld.%09ld %lld\n",
+		(long long)db.st_mtim.tv_sec, db.st_mtim.tv_nsec, (long long)db.st_size,
+		(long long)log.st_mtim.tv_sec, log.st_mtim.tv_nsec, (long long)log.st_size);
+}
+
+/* copy the primary to a temporary file and rename it over the replica */
+static int
+replica_copy(p3auth_ctx *ctx)
+{
+	struct module_options *options = ctx->options;
+	sqlite3 *src = NULL, *dst = NULL;
+	sqlite3_backup *b;
+	char tmp[PATH_MAX];
+	struct stat st;
+	int res = SQLITE_ERROR;
+
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", options->replica, (int)getpid());
+	unlink(tmp);
+	if (sqlite3_open_v2(options->database, &src, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK ||
+			sqlite3_open_v2(tmp, &dst, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+				NULL) != SQLITE_OK)
+		goto done;
+	if (!(b = sqlite3_backup_init(dst, "main", src, "main")))
+		goto done;
+	/* a step at a time, so writers to the primary are never held up long */
+	do {
+		res = sqlite3_backup_step(b, REPLICA_STEP_PAGES);
+		if (res == SQLITE_BUSY || res == SQLITE_LOCKED)
+			sqlite3_sleep(5);
+	} while (res == SQLITE_OK || res == SQLITE_BUSY || res == SQLITE_LOCKED);
+	sqlite3_backup_finish(b);
+	if (res != SQLITE_DONE)
+		goto done;
+	/* the copy must not carry the primary's WAL mode onto read-only readers */
+	sqlite3_exec(dst, "PRAGMA journal_mode=DELETE", NULL, NULL, NULL);
+
+done:
+	if (res != SQLITE_DONE)
+		SYSLOGERR("could not copy %s to %s: %s", options->database, tmp,
+			sqlite3_errmsg(dst ? dst : src));
+	sqlite3_close(src);
+	sqlite3_close(dst);
+	if (res == SQLITE_DONE && stat(options->database, &st) == 0)
+		chmod(tmp, st.st_mode & 07777);
+	if (res != SQLITE_DONE || rename(tmp, options->replica) != 0) {
+		if (res == SQLITE_DONE)
+			SYSLOGERR("could not replace %s: %s", options->replica, strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * The file read-only connections should open: the replica, refreshed
+ * first if it is due, or the primary if there is no replica to be had.
+ */
+const char *
+replica_path(p3auth_ctx *ctx)
+{
+	struct module_options *options = ctx->options;
+	char lock[PATH_MAX], sig[REPLICA_SIG_MAX], old[REPLICA_SIG_MAX];
+	struct stat st;
+	int fd, exists;
+	ssize_t n;
+
+	if (!options->replica)
+		return options->database;
+	if ((exists = stat(options->replica, &st) == 0) && replica_fresh(ctx, &st))
+		return options->replica;
+
+	snprintf(lock, sizeof(lock), "%s.lock", options->replica);
+	if ((fd = open(lock, O_RDWR | O_CREAT, 0600)) < 0) {
+		SYSLOGERR("cannot open %s: %s", lock, strerror(errno));
+		goto done;
+	}
+	/* with a replica to read, leave the refresh to whoever holds the lock */
+	if (flock(fd, exists ? LOCK_EX | LOCK_NB : LOCK_EX) != 0)
+		goto done;
+	if ((exists = stat(options->replica, &st) == 0) && replica_fresh(ctx, &st))
+		goto done;
+
+	replica_signature(options->database, sig, sizeof(sig));
+	n = pread(fd, old, sizeof(old) - 1, 0);
+	old[n > 0 ? n : 0] = '\0';
+	if (exists && !strcmp(sig, old)) {
+		utimensat(AT_FDCWD, options->replica, NULL, 0);
+	} else if (replica_copy(ctx) == 0) {
+		exists = 1;
+		if (pwrite(fd, sig, strlen(sig), 0) < 0 || ftruncate(fd, strlen(sig)) != 0)
+			SYSLOGERR("cannot record replica state in %s", lock);
+	}
+
+done:
+	if (fd >= 0)
+		close(fd);		/* and with it the lock */
+	return exists ? options->replica : options->database;
+}
+
+/* open the replica as it stands, see pam_sqlite3_connect() */
+sqlite3 *
+replica_connect(p3auth_ctx *ctx, int flags)
+{
+	const char *p;
+	char *uri, *q;
+	sqlite3 *db;
+
+	/* "file:" plus every byte percent-encoded at worst, plus the query */
+	if (!(uri = malloc(5 + 3 * strlen(ctx->options->replica) + 16)))
+		return NULL;
+	q = uri + sprintf(uri, "file:");
+	for (p = ctx->options->replica; *p; p++)
+		if (*p == '?' || *p == '#' || *p == '%')
+			q += sprintf(q, "%%%02X", (unsigned char)*p);
+		else
+			*q++ = *p;
+	strcpy(q, "?immutable=1");
+	db = pam_sqlite3_connect(ctx->options, uri, flags | SQLITE_OPEN_URI);
+	free(uri);
+	return db;
+}
+
+/* have the next read refresh the replica, after a write to the primary */
+void
+replica_invalidate(p3auth_ctx *ctx)
+{
+	const struct timespec epoch[2] = { { 0, 0 }, { 0, 0 } };
+
+	if (ctx->options->replica)
+		utimensat(AT_FDCWD, ctx->options->replica, epoch, 0);
+}
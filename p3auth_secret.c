@@ -0,0 +1,235 @@
+/*
+ * Memory for passwords, hashes and anything built from them.
+ *
+ * Secrets are carved from one pool per process: pages locked into RAM
+ * once, kept out of core dumps, with an inaccessible guard page at either
+ * end so an overrun faults instead of reading a neighbour's secret.  The
+ * pool is handed out in SECRET_CHUNK units under one lock; a release wipes
+ * the whole run of chunks, so callers need not know how much of a buffer
+ * they used, and everything the pool hands out starts zeroed.
+ *
+ * When the pool is full, or could not be set up, secrets fall back to the
+ * heap and are still wiped on release.
+ *
+ * This file is part of pam_sqlite3, see pam_sqlite3.c for copyright and
+ * licensing information.
+ */
+
+#include "pam_sqlite3_int.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#define SECRET_POOL_SIZE	(256 * 1024)	/* room for 7 crypt_data and change */
+#define SECRET_CHUNK		64
+#define SECRET_CHUNKS		(SECRET_POOL_SIZE / SECRET_CHUNK)
+#define SECRET_WORDS		(SECRET_CHUNKS / 64)
+
+/* in front of a secret that had to go on the heap */
+union secret_heap {
+	size_t size;
+	max_align_t align;
+};
+
+static struct {
+	unsigned char *base;		/* NULL if the pool could not be mapped */
+	size_t guard;				/* page size */
+	uint64_t used[SECRET_WORDS];	/* a bit per chunk */
+	uint16_t run[SECRET_CHUNKS];	/* chunks allocated from this one */
+	int spilled;				/* logged falling back to the heap */
+} pool;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+static void
+pool_prefork(void)
+{
+	pthread_mutex_lock(&pool_lock);
+}
+
+static void
+pool_parent(void)
+{
+	pthread_mutex_unlock(&pool_lock);
+}
+
+/* page locks are not inherited over fork() */
+static void
+pool_child(void)
+{
+	if (pool.base)
+		mlock(pool.base, SECRET_POOL_SIZE);
+	pthread_mutex_unlock(&pool_lock);
+}
+
+static void
+pool_init(void)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	unsigned char *map;
+
+	pool.guard = page > 0 ? (size_t)page : 4096;
+	map = mmap(NULL, SECRET_POOL_SIZE + 2 * pool.guard, PROT_NONE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		SYSLOGERR("secret pool unavailable: %m");
+		return;
+	}
+	if (mprotect(map + pool.guard, SECRET_POOL_SIZE, PROT_READ | PROT_WRITE) != 0) {
+		SYSLOGERR("secret pool unavailable: %m");
+		munmap(map, SECRET_POOL_SIZE + 2 * pool.guard);
+		return;
+	}
+	pool.base = map + pool.guard;
+	if (mlock(pool.base, SECRET_POOL_SIZE) != 0)
+		SYSLOG("could not lock secret pool into memory: %m");
+#ifdef MADV_DONTDUMP
+	madvise(pool.base, SECRET_POOL_SIZE, MADV_DONTDUMP);
+#endif
+	pthread_atfork(pool_prefork, pool_parent, pool_child);
+}
+
+static int
+in_pool(const void *p)
+{
+	return pool.base && (const unsigned char *)p >= pool.base &&
+		(const unsigned char *)p < pool.base + SECRET_POOL_SIZE;
+}
+
+static int
+chunk_used(size_t i)
+{
+	return (pool.used[i / 64] >> (i % 64)) & 1;
+}
+
+static void
+chunk_mark(size_t i, int used)
+{
+	if (used)
+		pool.used[i / 64] |= (uint64_t)1 << (i % 64);
+	else
+		pool.used[i / 64] &= ~((uint64_t)1 << (i % 64));
+}
+
+/* first run of n free chunks, or -1 */
+static long
+pool_take(size_t n)
+{
+	size_t i = 0, start, k;
+
+	while (i + n <= SECRET_CHUNKS) {
+		if (i % 64 == 0 && pool.used[i / 64] == UINT64_MAX) {
+			i += 64;
+			continue;
+		}
+		if (chunk_used(i)) {
+			i++;
+			continue;
+		}
+		for (start = i; i < start + n && !chunk_used(i); i++)
+			;
+		if (i == start + n) {
+			for (k = start; k < i; k++)
+				chunk_mark(k, 1);
+			pool.run[start] = n;
+			return start;
+		}
+	}
+	return -1;
+}
+
+/* zeroed memory for a secret of n bytes, NULL when out of memory */
+void *
+secret_alloc(size_t n)
+{
+	size_t chunks = (n + SECRET_CHUNK - 1) / SECRET_CHUNK;
+	union secret_heap *h;
+	long start = -1;
+
+	pthread_once(&pool_once, pool_init);
+	if (pool.base && chunks && chunks <= SECRET_CHUNKS) {
+		pthread_mutex_lock(&pool_lock);
+		start = pool_take(chunks);
+		if (start < 0 && !pool.spilled) {
+			pool.spilled = 1;
+			SYSLOG("secret pool full, using unlocked memory");
+		}
+		pthread_mutex_unlock(&pool_lock);
+	}
+	if (start >= 0)
+		return pool.base + start * SECRET_CHUNK;
+
+	if (!(h = calloc(1, sizeof(*h) + n)))
+		return NULL;
+	h->size = n;
+	return h + 1;
+}
+
+/* usable size of a secret buffer */
+static size_t
+secret_size(const void *p)
+{
+	if (in_pool(p))
+		return pool.run[((const unsigned char *)p - pool.base) / SECRET_CHUNK] *
+			(size_t)SECRET_CHUNK;
+	return ((const union secret_heap *)p - 1)->size;
+}
+
+/* wipe and release a buffer from secret_alloc(); NULL is ignored */
+void
+secret_free(void *p)
+{
+	union secret_heap *h;
+	size_t start, n, i;
+
+	if (!p)
+		return;
+	if (!in_pool(p)) {
+		h = (union secret_heap *)p - 1;
+		memzero_explicit(h, sizeof(*h) + h->size);
+		free(h);
+		return;
+	}
+	start = ((unsigned char *)p - pool.base) / SECRET_CHUNK;
+	n = pool.run[start];
+	memzero_explicit(p, n * SECRET_CHUNK);
+	pthread_mutex_lock(&pool_lock);
+	for (i = start; i < start + n; i++)
+		chunk_mark(i, 0);
+	pool.run[start] = 0;
+	pthread_mutex_unlock(&pool_lock);
+}
+
+/* grow a secret buffer, wiping the old one; NULL (p kept) on failure */
+void *
+secret_realloc(void *p, size_t n)
+{
+	size_t old;
+	void *q;
+
+	if (!p)
+		return secret_alloc(n);
+	if ((old = secret_size(p)) >= n)
+		return p;
+	if (!(q = secret_alloc(n)))
+		return NULL;
+	memcpy(q, p, old);
+	secret_free(p);
+	return q;
+}
+
+char *
+secret_strdup(const char *s)
+{
+	size_t len = strlen(s) + 1;
+	char *p;
+
+	if ((p = secret_alloc(len)))
+		memcpy(p, s, len);
+	return p;
+}
@@ -0,0 +1,401 @@
+/*
+ * Session accounting: per-user limits on concurrent sessions and a
+ * session_table row for every session.
+ *
+ * Live counts sit in a shared segment, an open addressing table keyed by
+ * user hash, so checking max_sessions is one probe under the segment lock
+ * whatever the number of users.  Rows for session_table are queued in
+ * memory and written by a background thread in one transaction per
+ * audit_flush_ms (or audit_batch events), like the audit trail: opening
+ * or closing a session never waits for the database.
+ *
+ * This file is part of pam_sqlite3, see pam_sqlite3.c for copyright and
+ * licensing information.
+ */
+
+#include "pam_sqlite3_int.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#define SESS_RING			256
+#define SESS_BUSY_TIMEOUT	5000	/* ms */
+#define SESS_TTY_MAX		32
+#define SESS_HOST_MAX		64
+
+struct sess_event {
+	int closed;				/* else opened */
+	sqlite3_int64 id;
+	time_t when;
+	char user[AUDIT_USER_MAX];
+	char service[AUDIT_SERVICE_MAX];
+	char tty[SESS_TTY_MAX];
+	char host[SESS_HOST_MAX];
+};
+
+struct p3auth_sess_log {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct sess_event ring[SESS_RING];
+	struct sess_event scratch[SESS_RING];	/* the writer's copy */
+	unsigned head, count;
+	uint64_t dropped;
+	int batch;
+	int flush_ms;
+	int started, stop;
+	pid_t pid;
+	pthread_t thread;
+	uint64_t salt;			/* for session ids */
+	uint64_t seq;
+
+	/* used only by the writer thread */
+	sqlite3 *db;
+	sqlite3_stmt *insert;
+	sqlite3_stmt *update;
+};
+
+static void
+sess_init(void *seg)
+{
+	struct p3auth_sess_shared *sh = seg;
+
+	p3auth_shm_mutex_init(&sh->lock);
+}
+
+/* the slot holding user, or the empty one where it would go */
+static struct p3auth_sess_slot *
+sess_find(struct p3auth_sess_shared *sh, uint64_t user)
+{
+	unsigned i, n;
+
+	for (i = user % SESS_SLOTS, n = 0; n < SESS_SLOTS; i = (i + 1) % SESS_SLOTS, n++)
+		if (!sh->slot[i].user || sh->slot[i].user == user)
+			return &sh->slot[i];
+	return NULL;
+}
+
+/* empty slot i, moving later entries of its probe run back into the gap */
+static void
+sess_remove(struct p3auth_sess_shared *sh, unsigned i)
+{
+	unsigned j = i, home;
+
+	for (;;) {
+		sh->slot[i].user = 0;
+		sh->slot[i].count = 0;
+		for (;;) {
+			j = (j + 1) % SESS_SLOTS;
+			if (!sh->slot[j].user)
+				return;
+			home = sh->slot[j].user % SESS_SLOTS;
+			/* j may fill the gap unless its home lies in (i, j] */
+			if (i <= j ? (home <= i || home > j) : (home <= i && home > j))
+				break;
+		}
+		sh->slot[i] = sh->slot[j];
+		i = j;
+	}
+}
+
+/* a user hash that is never the empty slot marker */
+static uint64_t
+sess_key(const char *user)
+{
+	uint64_t h = p3auth_user_hash(user);
+
+	return h ? h : 1;
+}
+
+int
+sess_open(p3auth_ctx *ctx)
+{
+	struct module_options *options = ctx->options;
+	struct p3auth_sess_log *l;
+	int fd;
+
+	if (options->max_sessions > 0 && !(ctx->sess = p3auth_shm_map(
+			options->session_shm ? options->session_shm : SESS_SHM_DEFAULT,
+			sizeof(*ctx->sess), sess_init)))
+		SYSLOGERR("session limits disabled");
+
+	if (!options->session_table)
+		return 0;
+	if (!(l = calloc(1, sizeof(*l))))
+		return -1;
+	l->batch = options->audit_batch > 0 ? options->audit_batch : 1;
+	if (l->batch > SESS_RING)
+		l->batch = SESS_RING;
+	l->flush_ms = options->audit_flush_ms > 0 ? options->audit_flush_ms : 1;
+	if ((fd = open("/dev/urandom", O_RDONLY)) >= 0) {
+		if (read(fd, &l->salt, sizeof(l->salt)) != sizeof(l->salt))
+			l->salt = 0;
+		close(fd);
+	}
+	if (!l->salt)
+		l->salt = (uint64_t)time(NULL) << 32;
+	pthread_mutex_init(&l->lock, NULL);
+	pthread_cond_init(&l->cond, NULL);
+	l->pid = getpid();
+	ctx->sess_log = l;
+	return 0;
+}
+
+/* open the session database and prepare the statements, in the writer */
+static int
+sess_connect(p3auth_ctx *ctx)
+{
+	struct module_options *options = ctx->options;
+	struct p3auth_sess_log *l = ctx->sess_log;
+	const char *path = options->audit_database ? options->audit_database :
+		options->database;
+	char *sql;
+
+	if (sqlite3_open_v2(path, &l->db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+			NULL) != SQLITE_OK)
+		goto fail;
+	sqlite3_busy_timeout(l->db, SESS_BUSY_TIMEOUT);
+
+	if (!(sql = sqlite3_mprintf("CREATE TABLE IF NOT EXISTS %s (id INTEGER "
+			"PRIMARY KEY, user TEXT, service TEXT, tty TEXT, host TEXT, "
+			"started INTEGER, ended INTEGER)", options->session_table)))
+		goto fail;
+	sqlite3_exec(l->db, sql, NULL, NULL, NULL);
+	sqlite3_free(sql);
+
+	if (!(sql = sqlite3_mprintf("INSERT INTO %s (id, user, service, tty, host, "
+			"started) VALUES (?,?,?,?,?,?)", options->session_table)))
+		goto fail;
+	sqlite3_prepare_v2(l->db, sql, -1, &l->insert, NULL);
+	sqlite3_free(sql);
+	if (!(sql = sqlite3_mprintf("UPDATE %s SET ended = ?2 WHERE id = ?1",
+			options->session_table)))
+		goto fail;
+	sqlite3_prepare_v2(l->db, sql, -1, &l->update, NULL);
+	sqlite3_free(sql);
+	if (!l->insert || !l->update)
+		goto fail;
+	return 0;
+
+fail:
+	SYSLOGERR("session database %s unusable: %s", path, sqlite3_errmsg(l->db));
+	sqlite3_finalize(l->insert);
+	sqlite3_finalize(l->update);
+	sqlite3_close(l->db);
+	l->db = NULL;
+	l->insert = l->update = NULL;
+	return -1;
+}
+
+/* write n events in one transaction */
+static void
+sess_write(p3auth_ctx *ctx, struct sess_event *e, unsigned n)
+{
+	struct p3auth_sess_log *l = ctx->sess_log;
+	sqlite3_stmt *vm;
+	unsigned i;
+	int err = 0;
+
+	if (!l->db && sess_connect(ctx) != 0)
+		return;
+
+	if (sqlite3_exec(l->db, "BEGIN", NULL, NULL, NULL) != SQLITE_OK)
+		err = 1;
+	for (i = 0; !err && i < n; i++) {
+		if (e[i].closed) {
+			vm = l->update;
+			sqlite3_bind_int64(vm, 1, e[i].id);
+			sqlite3_bind_int64(vm, 2, (sqlite3_int64)e[i].when);
+		} else {
+			vm = l->insert;
+			sqlite3_bind_int64(vm, 1, e[i].id);
+			sqlite3_bind_text(vm, 2, e[i].user, -1, SQLITE_STATIC);
+			sqlite3_bind_text(vm, 3, e[i].service, -1, SQLITE_STATIC);
+			sqlite3_bind_text(vm, 4, e[i].tty, -1, SQLITE_STATIC);
+			sqlite3_bind_text(vm, 5, e[i].host, -1, SQLITE_STATIC);
+			sqlite3_bind_int64(vm, 6, (sqlite3_int64)e[i].when);
+		}
+		err = sqlite3_step(vm) != SQLITE_DONE;
+		sqlite3_reset(vm);
+		sqlite3_clear_bindings(vm);
+	}
+	if (err || sqlite3_exec(l->db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+		SYSLOGERR("session records lost: %s", sqlite3_errmsg(l->db));
+		sqlite3_exec(l->db, "ROLLBACK", NULL, NULL, NULL);
+	}
+}
+
+static void *
+sess_thread(void *arg)
+{
+	p3auth_ctx *ctx = arg;
+	struct p3auth_sess_log *l = ctx->sess_log;
+	struct timespec deadline;
+	unsigned n, i;
+
+	pthread_mutex_lock(&l->lock);
+	for (;;) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += l->flush_ms / 1000;
+		deadline.tv_nsec += (l->flush_ms % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		while (!l->stop && l->count < (unsigned)l->batch)
+			if (pthread_cond_timedwait(&l->cond, &l->lock, &deadline) == ETIMEDOUT)
+				break;
+
+		if (l->dropped) {
+			SYSLOGERR("session queue full, %llu records dropped",
+				(unsigned long long)l->dropped);
+			l->dropped = 0;
+		}
+		if ((n = l->count)) {
+			for (i = 0; i < n; i++)
+				l->scratch[i] = l->ring[(l->head + i) % SESS_RING];
+			l->head = (l->head + n) % SESS_RING;
+			l->count = 0;
+			pthread_mutex_unlock(&l->lock);
+			sess_write(ctx, l->scratch, n);
+			pthread_mutex_lock(&l->lock);
+		}
+		if (l->stop && !l->count)
+			break;
+	}
+	pthread_mutex_unlock(&l->lock);
+	return NULL;
+}
+
+/* flush what is queued and stop the writer */
+void
+sess_close(p3auth_ctx *ctx)
+{
+	struct p3auth_sess_log *l = ctx->sess_log;
+
+	p3auth_shm_unmap(ctx->sess, sizeof(*ctx->sess));
+	ctx->sess = NULL;
+	if (!l)
+		return;
+
+	if (l->pid == getpid()) {
+		pthread_mutex_lock(&l->lock);
+		l->stop = 1;
+		pthread_cond_signal(&l->cond);
+		pthread_mutex_unlock(&l->lock);
+		if (l->started)
+			pthread_join(l->thread, NULL);
+		else if (l->count)
+			sess_thread(ctx);		/* never started: flush inline */
+		sqlite3_finalize(l->insert);
+		sqlite3_finalize(l->update);
+		sqlite3_close(l->db);
+		pthread_mutex_destroy(&l->lock);
+		pthread_cond_destroy(&l->cond);
+	}
+	free(l);
+	ctx->sess_log = NULL;
+}
+
+/* as for the audit trail, a forked child starts with an empty queue */
+static void
+sess_after_fork(struct p3auth_sess_log *l)
+{
+	pthread_mutex_init(&l->lock, NULL);
+	pthread_cond_init(&l->cond, NULL);
+	l->head = l->count = 0;
+	l->dropped = 0;
+	l->started = l->stop = 0;
+	l->db = NULL;
+	l->insert = l->update = NULL;
+	l->pid = getpid();
+}
+
+static void
+sess_queue(p3auth_ctx *ctx, int closed, sqlite3_int64 id, const char *user,
+	const char *tty, const char *host)
+{
+	struct p3auth_sess_log *l = ctx->sess_log;
+	const char *service = ctx->options->service;
+	struct sess_event *e;
+
+	if (l->pid != getpid())
+		sess_after_fork(l);
+
+	pthread_mutex_lock(&l->lock);
+	if (!l->started && !l->stop) {
+		if (pthread_create(&l->thread, NULL, sess_thread, ctx) == 0)
+			l->started = 1;
+	}
+	if (l->count == SESS_RING) {
+		l->dropped++;
+	} else {
+		e = &l->ring[(l->head + l->count++) % SESS_RING];
+		e->closed = closed;
+		e->id = id;
+		e->when = time(NULL);
+		snprintf(e->user, sizeof(e->user), "%s", user ? user : "");
+		snprintf(e->service, sizeof(e->service), "%s", service ? service : "");
+		snprintf(e->tty, sizeof(e->tty), "%s", tty ? tty : "");
+		snprintf(e->host, sizeof(e->host), "%s", host ? host : "");
+		if (l->count >= (unsigned)l->batch)
+			pthread_cond_signal(&l->cond);
+	}
+	pthread_mutex_unlock(&l->lock);
+}
+
+int
+p3auth_open_session(p3auth_ctx *ctx, const char *user, const char *tty,
+	const char *host, unsigned long long *id)
+{
+	struct module_options *options = ctx->options;
+	struct p3auth_sess_shared *sh = ctx->sess;
+	struct p3auth_sess_log *l = ctx->sess_log;
+	struct p3auth_sess_slot *s;
+	uint64_t key = sess_key(user);
+	int rc = P3AUTH_SUCCESS;
+
+	*id = 0;
+	if (sh && p3auth_shm_lock(&sh->lock) == 0) {
+		if (!(s = sess_find(sh, key))) {
+			SYSLOG("session table full, not limiting %s", user);
+		} else if (s->count >= (uint32_t)options->max_sessions) {
+			DBGLOG("%s already has %u sessions", user, s->count);
+			rc = P3AUTH_PERM_DENIED;
+		} else {
+			s->user = key;
+			s->count++;
+		}
+		pthread_mutex_unlock(&sh->lock);
+	}
+	if (rc != P3AUTH_SUCCESS || !l)
+		return rc;
+
+	/* the pid keeps ids apart in the children of one parent */
+	*id = (l->salt ^ ((uint64_t)getpid() << 40)) +
+		__atomic_add_fetch(&l->seq, 1, __ATOMIC_RELAXED);
+	*id &= INT64_MAX;
+	sess_queue(ctx, 0, *id, user, tty, host);
+	return rc;
+}
+
+void
+p3auth_close_session(p3auth_ctx *ctx, const char *user, unsigned long long id)
+{
+	struct p3auth_sess_shared *sh = ctx->sess;
+	struct p3auth_sess_slot *s;
+
+	if (sh && p3auth_shm_lock(&sh->lock) == 0) {
+		if ((s = sess_find(sh, sess_key(user))) && s->user && s->count &&
+				!--s->count)
+			sess_remove(sh, s - sh->slot);
+		pthread_mutex_unlock(&sh->lock);
+	}
+	if (ctx->sess_log && id)
+		sess_queue(ctx, 1, id, NULL, NULL, NULL);
+}
@@ -0,0 +1,161 @@
+/*
+ * Host-wide shared memory segments for p3auth.
+ *
+ * Every segment starts with a struct p3auth_shm_header.  The process that
+ * creates a segment initialises it and publishes the magic number last;
+ * everyone else waits for the magic before touching the contents, so the
+ * first-use race between many sshd children sorts itself out.
+ *
+ * This file is part of pam_sqlite3, see pam_sqlite3.c for copyright and
+ * licensing information.
+ */
+
+#include "pam_sqlite3_int.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#define SHM_MAGIC		0x70337368	/* "p3sh" */
+#define SHM_WAIT_TRIES	200			/* x 1ms for a creator to finish */
+
+static void *
+shm_map_fd(int fd, size_t size)
+{
+	void *seg = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	close(fd);
+	return seg == MAP_FAILED ? NULL : seg;
+}
+
+/* wait for the creator to publish the segment, NULL if it never does */
+static void *
+shm_wait_ready(void *seg, size_t size)
+{
+	struct p3auth_shm_header *hdr = seg;
+	struct timespec ms = { 0, 1000000 };
+	int i;
+
+	for (i = 0; i < SHM_WAIT_TRIES; i++) {
+		if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) == SHM_MAGIC) {
+			if (hdr->size == size)
+				return seg;
+			break;		/* left over from a different build */
+		}
+		nanosleep(&ms, NULL);
+	}
+	munmap(seg, size);
+	return NULL;
+}
+
+/*
+ * Map the named segment, creating and initialising it with init() if it
+ * does not exist yet.  Returns NULL (and logs) on failure.
+ */
+void *
+p3auth_shm_map(const char *name, size_t size, void (*init)(void *))
+{
+	struct p3auth_shm_header *hdr;
+	struct stat st;
+	int fd, i;
+
+	if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) >= 0) {
+		if (ftruncate(fd, size) != 0 || !(hdr = shm_map_fd(fd, size))) {
+			SYSLOGERR("could not create shared segment %s: %m", name);
+			shm_unlink(name);
+			return NULL;
+		}
+		hdr->size = size;
+		if (init)
+			init(hdr);
+		__atomic_store_n(&hdr->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+		return hdr;
+	}
+
+	if (errno != EEXIST || (fd = shm_open(name, O_RDWR, 0)) < 0) {
+		SYSLOGERR("could not open shared segment %s: %m", name);
+		return NULL;
+	}
+	/* the creator may not have sized it yet */
+	st.st_size = 0;
+	for (i = 0; i < SHM_WAIT_TRIES; i++) {
+		struct timespec ms = { 0, 1000000 };
+
+		if (fstat(fd, &st) == 0 && st.st_size >= (off_t)size)
+			break;
+		nanosleep(&ms, NULL);
+	}
+	if (st.st_size < (off_t)size || !(hdr = shm_map_fd(fd, size))) {
+		if (st.st_size < (off_t)size)
+			close(fd);
+		SYSLOGERR("shared segment %s is not usable", name);
+		return NULL;
+	}
+	if (!(hdr = shm_wait_ready(hdr, size)))
+		SYSLOGERR("shared segment %s was never initialised", name);
+	return hdr;
+}
+
+/* map an existing segment without creating it, NULL if there is none */
+void *
+p3auth_shm_attach(const char *name, size_t size)
+{
+	void *seg;
+	int fd;
+
+	if ((fd = shm_open(name, O_RDWR, 0)) < 0)
+		return NULL;
+	if (!(seg = shm_map_fd(fd, size)))
+		return NULL;
+	return shm_wait_ready(seg, size);
+}
+
+void
+p3auth_shm_unmap(void *seg, size_t size)
+{
+	if (seg)
+		munmap(seg, size);
+}
+
+/* a mutex usable across processes that survives its holder dying */
+void
+p3auth_shm_mutex_init(pthread_mutex_t *m)
+{
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(m, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+void
+p3auth_shm_cond_init(pthread_cond_t *c)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_cond_init(c, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+/* lock a shared mutex, recovering it if the last holder died */
+int
+p3auth_shm_lock(pthread_mutex_t *m)
+{
+	int rc = pthread_mutex_lock(m);
+
+	if (rc == EOWNERDEAD) {
+		pthread_mutex_consistent(m);
+		rc = 0;
+	}
+	return rc;
+}
@@ -0,0 +1,191 @@
+/*
+ * Traffic trace: one line per PAM call appended to trace_file, for
+ * pam_sqlite3-replay.
+ *
+ * The file starts with a header carrying a random salt; users appear only
+ * as a salted hash of their name, which the replay tool maps back onto
+ * the users of a database copy.  Each record is written with a single
+ * write() to a file opened O_APPEND, so every process using the module
+ * can share one trace.
+ *
+ * This file is part of pam_sqlite3, see pam_sqlite3.c for copyright and
+ * licensing information.
+ */
+
+#include "pam_sqlite3_int.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#define TRACE_LINE_MAX		256
+#define TRACE_HEADER_TRIES	50		/* 1ms apart, for a racing creator */
+
+struct p3auth_trace {
+	pthread_mutex_t lock;
+	int fd;					/* -1 until the first record */
+	int failed;
+	uint64_t salt;
+};
+
+/* the name a user is recorded under */
+uint64_t
+trace_pseudonym(uint64_t salt, const char *user)
+{
+	uint64_t h = 0xcbf29ce484222325ULL ^ salt;
+
+	while (*user) {
+		h ^= (unsigned char)*user++;
+		h *= 0x100000001b3ULL;
+	}
+	/* fold the high bits down so similar names differ everywhere */
+	h ^= h >> 29;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	return h ^ (h >> 32);
+}
+
+/* read the salt from a trace header; -1 if there is none (yet) */
+int
+trace_read_header(int fd, uint64_t *salt)
+{
+	char buf[64];
+	unsigned long long s;
+	ssize_t n;
+
+	if ((n = pread(fd, buf, sizeof(buf) - 1, 0)) <= 0)
+		return -1;
+	buf[n] = '\0';
+	if (sscanf(buf, TRACE_MAGIC " salt=%16llx\n", &s) != 1)
+		return -1;
+	*salt = s;
+	return 0;
+}
+
+static uint64_t
+trace_new_salt(void)
+{
+	struct timespec ts;
+	uint64_t salt = 0;
+	int fd;
+
+	if ((fd = open("/dev/urandom", O_RDONLY)) >= 0) {
+		if (read(fd, &salt, sizeof(salt)) != sizeof(salt))
+			salt = 0;
+		close(fd);
+	}
+	if (!salt) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		salt = ((uint64_t)ts.tv_sec << 32) ^ ts.tv_nsec ^ ((uint64_t)getpid() << 16);
+	}
+	return salt;
+}
+
+/* create the trace with its header, or join one another process created */
+static int
+trace_attach(p3auth_ctx *ctx)
+{
+	struct p3auth_trace *t = ctx->trace;
+	const char *path = ctx->options->trace_file;
+	char header[64];
+	int fd, len, i;
+
+	if ((fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_EXCL, 0600)) >= 0) {
+		t->salt = trace_new_salt();
+		len = snprintf(header, sizeof(header), TRACE_MAGIC " salt=%016llx\n",
+			(unsigned long long)t->salt);
+		if (write(fd, header, len) != len) {
+			close(fd);
+			goto fail;
+		}
+		t->fd = fd;
+		return 0;
+	}
+	if (errno != EEXIST || (fd = open(path, O_RDWR | O_APPEND)) < 0)
+		goto fail;
+	for (i = 0; trace_read_header(fd, &t->salt) != 0; i++) {
+		if (i == TRACE_HEADER_TRIES) {
+			close(fd);
+			SYSLOGERR("%s is not a pam_sqlite3 trace", path);
+			return -1;
+		}
+		usleep(1000);
+	}
+	t->fd = fd;
+	return 0;
+
+fail:
+	SYSLOGERR("cannot write trace %s: %s", path, strerror(errno));
+	return -1;
+}
+
+int
+trace_open(p3auth_ctx *ctx)
+{
+	struct p3auth_trace *t;
+
+	if (!ctx->options->trace_file)
+		return 0;
+	if (!(t = calloc(1, sizeof(*t))))
+		return -1;
+	pthread_mutex_init(&t->lock, NULL);
+	t->fd = -1;
+	ctx->trace = t;
+	return 0;
+}
+
+void
+trace_close(p3auth_ctx *ctx)
+{
+	struct p3auth_trace *t = ctx->trace;
+
+	if (!t)
+		return;
+	if (t->fd >= 0)
+		close(t->fd);
+	pthread_mutex_destroy(&t->lock);
+	free(t);
+	ctx->trace = NULL;
+}
+
+/*
+ * Append a record of one call that took total microseconds, of which
+ * setup went on finding the profile and conv on waiting for the user.
+ */
+void
+trace_record(p3auth_ctx *ctx, const char *op, const char *user, int result,
+	uint64_t total, uint64_t setup, uint64_t conv)
+{
+	struct p3auth_trace *t = ctx ? ctx->trace : NULL;
+	char line[TRACE_LINE_MAX];
+	struct timespec now;
+	uint64_t start;
+	int len;
+
+	if (!t)
+		return;
+
+	pthread_mutex_lock(&t->lock);
+	if (t->fd < 0 && !t->failed && trace_attach(ctx) != 0)
+		t->failed = 1;
+	pthread_mutex_unlock(&t->lock);
+	if (t->fd < 0)
+		return;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	start = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000 - total;
+	len = snprintf(line, sizeof(line), "%llu %s %016llx %d %llu %llu %llu\n",
+		(unsigned long long)start, op,
+		(unsigned long long)trace_pseudonym(t->salt, user ? user : ""),
+		result, (unsigned long long)total, (unsigned long long)setup,
+		(unsigned long long)conv);
+	if (write(t->fd, line, len) != len) {
+		struct module_options *options = ctx->options;
+
+		DBGLOG("short write to trace %s", options->trace_file);
+	}
+}
@@ -39,12 +39,6 @@
 
 static int   pam_conv_pass(pam_handle_t *, const char *, int);
 
-void memzero_explicit(void *s, size_t cnt)
-{
-    memset(s, 0, cnt);
-    __asm__ __volatile__("": :"r"(s): "memory");
-}
-
 static int
 pam_conv_pass(pam_handle_t *pamh, const char *prompt, int options)
 {
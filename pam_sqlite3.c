@@ -38,12 +38,11 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 
 /* $Id: pam_sqlite.c,v 1.11 2003/07/17 13:47:07 wez Exp $ */
 
-#include "config.h"
+#include "pam_sqlite3_int.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
-#include <syslog.h>
 #include <ctype.h>
 #if HAVE_UNISTD_H
 #include <unistd.h>
@@ -52,14 +51,13 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #include <sys/types.h>
 #endif
 #include <time.h>
-#include <sqlite3.h>
-#if HAVE_CRYPT_H
-#include <crypt.h>
-#endif
+#include <sys/stat.h>
+#include <pthread.h>
 
 #define PAM_SM_AUTH
 #define PAM_SM_ACCOUNT
 #define PAM_SM_PASSWORD
+#define PAM_SM_SESSION
 #include <security/pam_modules.h>
 #include <security/pam_appl.h>
 #include "pam_mod_misc.h"
@@ -67,574 +65,402 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #define PASSWORD_PROMPT			"Password: "
 #define PASSWORD_PROMPT_NEW		"New password: "
 #define PASSWORD_PROMPT_CONFIRM "Confirm new password: "
-#define CONF					"/etc/pam_sqlite3.conf"
-
-#define DBGLOG(x...)  if(options->debug) {							\
-						  openlog("PAM_sqlite3", LOG_PID, LOG_AUTH); \
-						  syslog(LOG_DEBUG, ##x);					\
-						  closelog();								\
-					  }
-#define SYSLOG(x...)  do {											\
-						  openlog("PAM_sqlite3", LOG_PID, LOG_AUTH); \
-						  syslog(LOG_INFO, ##x);					\
-						  closelog();								\
-					  } while(0)
-#define SYSLOGERR(x...) SYSLOG("Error: " x)
-
-typedef enum {
-	PW_CLEAR = 1,
-#if HAVE_MD5_CRYPT
-	PW_MD5,
-#endif
-#if HAVE_SHA256_CRYPT
-	PW_SHA256,
-#endif
-#if HAVE_SHA512_CRYPT
-	PW_SHA512,
-#endif
-	PW_CRYPT,
-} pw_scheme;
-
-struct module_options {
-	char *database;
-	char *table;
-	char *user_column;
-	char *pwd_column;
-	char *expired_column;
-	char *newtok_column;
-	pw_scheme pw_type;
-	int debug;
-	char *sql_verify;
-	char *sql_check_expired;
-	char *sql_check_newtok;
-	char *sql_set_passwd;
-};
-
-#define FAIL(MSG) 		\
-	{ 					\
-		SYSLOGERR(MSG);	\
-		free(buf); 		\
-		return NULL; 	\
-	}
-
-#define GROW(x)		if (x > buflen - dest - 1) {       		\
-	char *grow;                                        		\
-	buflen += 256 + x;                                 		\
-	grow = realloc(buf, buflen + 256 + x);             		\
-	if (grow == NULL) FAIL("Out of memory building query"); \
-	buf = grow;                                        		\
-}
-
-#define APPEND(str, len)	GROW(len); memcpy(buf + dest, str, len); dest += len
-#define APPENDS(str)	len = strlen(str); APPEND(str, len)
 
-#define MAX_ZSQL -1
+#define PROFILE_BUCKETS			64
+#define PRELOAD_ENV				"PAM_SQLITE3_PRELOAD"
+#define PRELOAD_MAX_ARGS		32
+#define PAM_D					"/etc/pam.d"
+#define SESSION_DATA			"pam_sqlite3_session"
 
 /*
- * Being very defensive here. The current logic in the rest of the code should prevent this from
- * happening. But lets protect against future code changes which could cause a NULL ptr to creep
- * in.
+ * private: a prepared engine context for one service and module argument
+ * list.  Profiles are built on first use and kept for the life of the
+ * process, so later calls skip option parsing and template compilation
+ * and reuse the context's open connections.
  */
-#define CHECK_STRING(str) 													 	\
-	if (!str) 															    	\
-		FAIL("Internal error in format_query: string ptr " #str " was NULL");
-
-static char *format_query(const char *template, struct module_options *options,
-	const char *user, const char *passwd)
-{
-	char *buf = malloc(256);
-	if (!buf)
-		return NULL;
-
-	int buflen = 256;
-	int dest = 0, len;
-	const char *src = template;
-	char *pct;
-	char *tmp;
-
-	while (*src) {
-		pct = strchr(src, '%');
+struct profile {
+	struct profile *next;
+	char *key;				/* service and arguments, NUL separated */
+	size_t keylen;
+	uint64_t stamp;			/* of the config files it was read from */
+	p3auth_ctx *ctx;
+	int std_flags;
+	int refs;				/* calls using it, plus one while in the table */
+};
 
-		if (pct) {
-			/* copy from current position to % char into buffer */
-			if (pct != src) {
-				len = pct - src;
-				APPEND(src, len);
-			}
+static pthread_mutex_t profiles_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct profile *profiles[PROFILE_BUCKETS];
 
-			/* decode the escape */
-			switch(pct[1]) {
-				case 'U':	/* username */
-					if (user) {
-						tmp = sqlite3_mprintf("%q", user);
-						if (!tmp)
-							FAIL("sqlite3_mprintf out of memory");
-						len = strlen(tmp);
-						APPEND(tmp, len);
-						sqlite3_free(tmp);
-					}
-					break;
-				case 'P':	/* password */
-					if (passwd) {
-						tmp = sqlite3_mprintf("%q", passwd);
-						if (!tmp)
-							FAIL("sqlite3_mprintf out of memory");
-						len = strlen(tmp);
-						APPEND(tmp, len);
-						sqlite3_free(tmp);
-					}
-					break;
-
-				case 'O':	/* option value */
-					pct++;
-					switch (pct[1]) {
-						case 'p':	/* passwd */
-							CHECK_STRING(options->pwd_column);
-							APPENDS(options->pwd_column);
-							break;
-						case 'u':	/* username */
-							CHECK_STRING(options->user_column);
-							APPENDS(options->user_column);
-							break;
-						case 't':	/* table */
-							CHECK_STRING(options->table);
-							APPENDS(options->table);
-							break;
-						case 'x':	/* expired */
-							CHECK_STRING(options->expired_column);
-							APPENDS(options->expired_column);
-							break;
-						case 'n':	/* newtok */
-							CHECK_STRING(options->newtok_column);
-							APPENDS(options->newtok_column);
-							break;
-					}
-					break;
-
-				case '%':	/* quoted % sign */
-					APPEND(pct, 1);
-					break;
-
-				default:	/* unknown */
-					APPEND(pct, 2);
-					break;
-			}
-			src = pct + 2;
-		} else {
-			/* copy rest of string into buffer and we're done */
-			len = strlen(src);
-			APPEND(src, len);
-			break;
-		}
+/* private: FNV-1a over a buffer that may contain NULs */
+static uint64_t
+hash_bytes(const char *buf, size_t len, uint64_t h)
+{
+	while (len--) {
+		h ^= (unsigned char)*buf++;
+		h *= 0x100000001b3ULL;
 	}
-
-	buf[dest] = '\0';
-	return buf;
+	return h;
 }
 
-static void
-get_module_options_from_file(const char *filename, struct module_options *opts, int warn);
-
-/*
- * safe_assign protects against duplicate config options causing a memory leak.
- */
-static void inline
-safe_assign(char **asignee, const char *val)
+/* private: fold a config file's identity and mtime into a stamp */
+static uint64_t
+stamp_file(const char *filename, uint64_t h)
 {
-	if(*asignee)
-		free(*asignee);
-	*asignee = strdup(val);
+	struct stat st;
+
+	memset(&st, 0, sizeof(st));
+	if (stat(filename, &st) != 0)
+		return hash_bytes("", 1, h);
+	h = hash_bytes((const char *)&st.st_ino, sizeof(st.st_ino), h);
+	h = hash_bytes((const char *)&st.st_size, sizeof(st.st_size), h);
+	return hash_bytes((const char *)&st.st_mtime, sizeof(st.st_mtime), h);
 }
 
-/* private: parse and set the specified string option */
-static void
-set_module_option(const char *option, struct module_options *options)
+/* private: changes whenever a config file the profile reads is edited */
+static uint64_t
+config_stamp(int argc, const char **argv)
 {
-	char *buf, *eq;
-	char *val, *end;
-
-	if(!option || !*option)
-		return;
-
-	buf = strdup(option);
-	if(!buf)
-		return;
-
-	if((eq = strchr(buf, '='))) {
-		end = eq - 1;
-		val = eq + 1;
-		if(end <= buf || !*val)
-		{
-			free(buf);
-			return;
-		}
-		while(end > buf && isspace(*end))
-			end--;
-		end++;
-		*end = '\0';
-		while(*val && isspace(*val))
-			val++;
-	} else {
-		val = NULL;
-	}
+	uint64_t h = stamp_file(CONF, 0xcbf29ce484222325ULL);
+	int i;
 
-	DBGLOG("setting option: %s=>%s\n", buf, val);
-
-	if(!strcmp(buf, "database")) {
-		safe_assign(&options->database, val);
-	} else if(!strcmp(buf, "table")) {
-		safe_assign(&options->table, val);
-	} else if(!strcmp(buf, "user_column")) {
-		safe_assign(&options->user_column, val);
-	} else if(!strcmp(buf, "pwd_column")) {
-		safe_assign(&options->pwd_column, val);
-	} else if(!strcmp(buf, "expired_column")) {
-		safe_assign(&options->expired_column, val);
-	} else if(!strcmp(buf, "newtok_column")) {
-		safe_assign(&options->newtok_column, val);
-	} else if(!strcmp(buf, "pw_type")) {
-		options->pw_type = PW_CLEAR;
-		if(!strcmp(val, "crypt")) {
-			options->pw_type = PW_CRYPT;
-		}
-#if HAVE_MD5_CRYPT
-		else if(!strcmp(val, "md5")) {
-			options->pw_type = PW_MD5;
-		}
-#endif
-#if HAVE_SHA256_CRYPT
-		else if(!strcmp(val, "sha-256")) {
-			options->pw_type = PW_SHA256;
-		}
-#endif
-#if HAVE_SHA512_CRYPT
-		else if(!strcmp(val, "sha-512")) {
-			options->pw_type = PW_SHA512;
-		}
-#endif
-	} else if(!strcmp(buf, "debug")) {
-		options->debug = 1;
-	} else if (!strcmp(buf, "config_file")) {
-		get_module_options_from_file(val, options, 1);
-	} else if (!strcmp(buf, "sql_verify")) {
-		safe_assign(&options->sql_verify, val);
-	} else if (!strcmp(buf, "sql_check_expired")) {
-		safe_assign(&options->sql_check_expired, val);
-	} else if (!strcmp(buf, "sql_check_newtok")) {
-		safe_assign(&options->sql_check_newtok, val);
-	} else if (!strcmp(buf, "sql_set_passwd")) {
-		safe_assign(&options->sql_set_passwd, val);
-	} else {
-		DBGLOG("ignored option: %s\n", buf);
-	}
+	for (i = 0; i < argc; i++)
+		if (!strncmp(argv[i], "config_file=", 12))
+			h = stamp_file(argv[i] + 12, h);
+	return h;
+}
 
-	free(buf);
+static void
+profile_free(struct profile *p)
+{
+	p3auth_free(p->ctx);
+	free(p->key);
+	free(p);
 }
 
-/* private: read module options from a config file */
+/* private: drop a reference taken by get_profile() */
 static void
-get_module_options_from_file(const char *filename, struct module_options *opts, int warn)
+put_profile(struct profile *p)
 {
-	FILE *fp;
+	int last;
 
-	if ((fp = fopen(filename, "r"))) {
-		char line[1024];
-		char *str, *end;
-
-		while(fgets(line, sizeof(line), fp)) {
-			str = line;
-			end = line + strlen(line) - 1;
-			while(*str && isspace(*str))
-				str++;
-			while(end > str && isspace(*end))
-				end--;
-			end++;
-			*end = '\0';
-			set_module_option(str, opts);
-		}
-		fclose(fp);
-	} else if (warn) {
-		SYSLOG("unable to read config file %s", filename);
-	}
+	if (!p)
+		return;
+	pthread_mutex_lock(&profiles_lock);
+	last = --p->refs == 0;
+	pthread_mutex_unlock(&profiles_lock);
+	if (last)
+		profile_free(p);
 }
 
-/* private: read module options from file or commandline */
-static int
-get_module_options(int argc, const char **argv, struct module_options **options)
+/* private: build a context from the config file and module arguments */
+static struct profile *
+profile_build(const char *service, int argc, const char **argv)
 {
-	int i, rc;
-	struct module_options *opts;
+	struct profile *p;
+	p3auth_ctx *c;
+	int i;
 
-	rc = 0;
-	if (!(opts = (struct module_options *)malloc(sizeof *opts))){
-		*options = NULL;
-		return rc;
+	PROBE1(profile__build, service);
+	if (!(p = calloc(1, sizeof(*p))) || !(p->ctx = c = p3auth_new()) ||
+			p3auth_set_service(c, service) != 0) {
+		if (p)
+			p3auth_free(p->ctx);
+		free(p);
+		return NULL;
 	}
 
-	bzero(opts, sizeof(*opts));
-	opts->pw_type = PW_CLEAR;
-
-	get_module_options_from_file(CONF, opts, 0);
+	p3auth_load_config(c, CONF);
 
 	for(i = 0; i < argc; i++) {
-		if(pam_std_option(&rc, argv[i]) == 0)
+		if(pam_std_option(&p->std_flags, argv[i]) == 0)
 			continue;
-		set_module_option(argv[i], opts);
+		p3auth_set_option(c, argv[i]);
 	}
-	*options = opts;
 
-	return rc;
+	if(p3auth_prepare(c) != 0) {
+		p3auth_free(c);
+		free(p);
+		return NULL;
+	}
+	return p;
 }
 
-/* private: free module options returned by get_module_options() */
-static void
-free_module_options(struct module_options *options)
+/*
+ * private: the profile for this service and argument list, built from the
+ * config file on first use and rebuilt when the file changes.  NULL if the
+ * options are incomplete.  Release it with put_profile().
+ */
+static struct profile *
+find_profile(const char *service, int argc, const char **argv)
 {
-	if (!options)
-		return;
+	struct profile *p, **pp, *stale = NULL, *fresh;
+	uint64_t hash, stamp;
+	size_t keylen, len;
+	char *key;
+	int i;
 
-	if(options->database)
-		free(options->database);
-	if(options->table)
-		free(options->table);
-	if(options->user_column)
-		free(options->user_column);
-	if(options->pwd_column)
-		free(options->pwd_column);
-	if(options->expired_column)
-		free(options->expired_column);
-	if(options->newtok_column)
-		free(options->newtok_column);
-	if(options->sql_verify)
-		free(options->sql_verify);
-	if(options->sql_check_expired)
-		free(options->sql_check_expired);
-	if(options->sql_check_newtok)
-		free(options->sql_check_newtok);
-	if(options->sql_set_passwd)
-		free(options->sql_set_passwd);
-
-	bzero(options, sizeof(*options));
-	free(options);
-}
+	keylen = (service ? strlen(service) : 0) + 1;
+	for (i = 0; i < argc; i++)
+		keylen += strlen(argv[i]) + 1;
+	if (!(key = malloc(keylen)))
+		return NULL;
+	len = 0;
+	if (service) {
+		strcpy(key, service);
+		len = strlen(service);
+	}
+	key[len++] = '\0';
+	for (i = 0; i < argc; i++) {
+		strcpy(key + len, argv[i]);
+		len += strlen(argv[i]) + 1;
+	}
+	hash = hash_bytes(key, keylen, 0xcbf29ce484222325ULL);
+	stamp = config_stamp(argc, argv);
 
-/* private: make sure required options are present (in cmdline or conf file) */
-static int
-options_valid(struct module_options *options)
-{
-	if(!options)
-	{
-		SYSLOGERR("failed to read options.");
-		return -1;
+	pthread_mutex_lock(&profiles_lock);
+	for (pp = &profiles[hash % PROFILE_BUCKETS]; (p = *pp); pp = &p->next) {
+		if (p->keylen != keylen || memcmp(p->key, key, keylen))
+			continue;
+		if (p->stamp == stamp) {
+			p->refs++;
+			pthread_mutex_unlock(&profiles_lock);
+			free(key);
+			return p;
+		}
+		/* the config changed: retire it once current callers are done */
+		*pp = p->next;
+		if (--p->refs == 0)
+			stale = p;
+		break;
 	}
+	pthread_mutex_unlock(&profiles_lock);
+	if (stale)
+		profile_free(stale);
 
-	if(options->database == 0 || options->table == 0 || options->user_column == 0)
-	{
-		SYSLOGERR("the database, table and user_column options are required.");
-		return -1;
+	if (!(fresh = profile_build(service, argc, argv))) {
+		free(key);
+		return NULL;
 	}
-	return 0;
+	fresh->key = key;
+	fresh->keylen = keylen;
+	fresh->stamp = stamp;
+	fresh->refs = 2;
+
+	/* another thread may have built the same profile meanwhile */
+	pthread_mutex_lock(&profiles_lock);
+	for (pp = &profiles[hash % PROFILE_BUCKETS]; (p = *pp); pp = &p->next) {
+		if (p->keylen == keylen && !memcmp(p->key, key, keylen) &&
+				p->stamp == stamp) {
+			p->refs++;
+			break;
+		}
+	}
+	if (!p) {
+		fresh->next = profiles[hash % PROFILE_BUCKETS];
+		profiles[hash % PROFILE_BUCKETS] = fresh;
+		p = fresh;
+		fresh = NULL;
+	}
+	pthread_mutex_unlock(&profiles_lock);
+	if (fresh)
+		profile_free(fresh);
+	return p;
 }
 
-/* private: open SQLite database */
-static sqlite3 *pam_sqlite3_connect(struct module_options *options)
+/* private: the profile for the calling service, see find_profile() */
+static struct profile *
+get_profile(pam_handle_t *pamh, int argc, const char **argv)
 {
-  const char *errtext = NULL;
-  sqlite3 *sdb = NULL;
-
-  if (sqlite3_open(options->database, &sdb) != SQLITE_OK) {
-      errtext = sqlite3_errmsg(sdb);
-	  SYSLOG("Error opening SQLite database (%s)", errtext);
-	  /*
-	   * N.B. sdb is usually non-NULL when errors occur, so we explicitly
-	   * release the resource and return NULL to indicate failure to the caller.
-	   */
-
-	  sqlite3_close(sdb);
-	  return NULL;
-  }
-
-  return sdb;
+	const char *service = NULL;
+	struct profile *p;
+
+	if (pam_get_item(pamh, PAM_SERVICE, (const void **)&service) != PAM_SUCCESS)
+		service = NULL;
+	PROBE1(profile__start, service);
+	p = find_profile(service, argc, argv);
+	PROBE2(profile__done, service, p != NULL);
+	return p;
 }
 
-/* private: generate random salt character */
-static char *
-crypt_make_salt(struct module_options *options)
+/*
+ * private: keep fork() from handing a child a lock some other thread
+ * held, by holding them all across it
+ */
+static void
+profiles_prefork(void)
 {
+	struct profile *p;
 	int i;
-	time_t now;
-	static unsigned long x;
-	static char result[22];
-	static char salt_chars[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789./";
-	static const int NUM_SALT_CHARS = sizeof(salt_chars) / sizeof(salt_chars[0]);
-
-	time(&now);
-	x += now + getpid() + clock();
-	srandom(x);
-
-	for (i=0; i<19; i++) {
-		result[i] = salt_chars[random() % NUM_SALT_CHARS];
-	}
-	result[i+1] = '$';
-	result[i+2]='\0';
-
-	switch(options->pw_type) {
-	case PW_CRYPT:
-		result[2] = '\0';
-		break;
-#if HAVE_MD5_CRYPT
-	case PW_MD5:
-		result[0]='$';
-		result[1]='1';
-		result[2]='$';
-		break;
-#endif
-#if HAVE_SHA256_CRYPT
-	case PW_SHA256:
-		result[0]='$';
-		result[1]='5';
-		result[2]='$';
-		break;
-#endif
-#if HAVE_SHA512_CRYPT
-	case PW_SHA512:
-		result[0]='$';
-		result[1]='6';
-		result[2]='$';
-		break;
-#endif
-	default:
-		result[0] = '\0';
-	}
 
-	return result;
+	pthread_mutex_lock(&profiles_lock);
+	for (i = 0; i < PROFILE_BUCKETS; i++)
+		for (p = profiles[i]; p; p = p->next) {
+			pthread_mutex_lock(&p->ctx->writer_lock);
+			pthread_mutex_lock(&p->ctx->conn_lock);
+		}
 }
 
-/* private: encrypt password using the preferred encryption scheme */
-static char *
-encrypt_password(struct module_options *options, const char *pass)
+static void
+profiles_postfork(void)
 {
-	char *s = NULL;
+	struct profile *p;
+	int i;
 
-	switch(options->pw_type) {
-#if HAVE_MD5_CRYPT
-		case PW_MD5:
-#endif
-#if HAVE_SHA256_CRYPT
-		case PW_SHA256:
-#endif
-#if HAVE_SHA512_CRYPT
-		case PW_SHA512:
-#endif
-		case PW_CRYPT:
-			s = strdup(crypt(pass, crypt_make_salt(options)));
-			break;
-		case PW_CLEAR:
-		default:
-			s = strdup(pass);
-	}
-	return s;
+	for (i = 0; i < PROFILE_BUCKETS; i++)
+		for (p = profiles[i]; p; p = p->next) {
+			pthread_mutex_unlock(&p->ctx->conn_lock);
+			pthread_mutex_unlock(&p->ctx->writer_lock);
+		}
+	pthread_mutex_unlock(&profiles_lock);
 }
 
-/* private: authenticate user and passwd against database */
-static int
-auth_verify_password(const char *user, const char *passwd,
-					 struct module_options *options)
+/*
+ * private: build and warm the profiles of one service's pam_sqlite3 lines
+ * in /etc/pam.d, then close their connections so that children forked
+ * later open their own.
+ */
+static void
+preload_service(const char *service)
 {
-	int res;
-	sqlite3 *conn = NULL;
-	sqlite3_stmt *vm = NULL;
-	int rc = PAM_AUTH_ERR;
-	const char *tail  = NULL;
-	const char *errtext = NULL;
-	const char *encrypted_pw = NULL;
-	char *query  = NULL;
-
-	if(!(conn = pam_sqlite3_connect(options))) {
-		rc = PAM_AUTH_ERR;
-		goto done;
-	}
+	char path[256], line[1024], *tok, *save, *argv[PRELOAD_MAX_ARGS];
+	struct profile *p;
+	FILE *fp;
+	int argc, found;
 
-	if(!(query = format_query(options->sql_verify ? options->sql_verify :
-			"SELECT %Op FROM %Ot WHERE %Ou='%U'",
-			options, user, passwd))) {
-		SYSLOGERR("failed to construct sql query");
-		rc = PAM_AUTH_ERR;
-		goto done;
+	if (strchr(service, '/') ||
+			snprintf(path, sizeof(path), PAM_D "/%s", service) >= (int)sizeof(path) ||
+			!(fp = fopen(path, "r")))
+		return;
+	while (fgets(line, sizeof(line), fp)) {
+		argc = found = 0;
+		for (tok = strtok_r(line, " \t\n", &save); tok && *tok != '#';
+				tok = strtok_r(NULL, " \t\n", &save)) {
+			if (found && argc < PRELOAD_MAX_ARGS)
+				argv[argc++] = tok;
+			else if (!found && strstr(tok, "pam_sqlite3.so"))
+				found = 1;
+		}
+		if (!found || !(p = find_profile(service, argc, (const char **)argv)))
+			continue;
+		p3auth_warm(p->ctx);
+		p3auth_release_connections(p->ctx);
+		put_profile(p);
 	}
+	fclose(fp);
+}
 
-	DBGLOG("query: %s", query);
+/*
+ * private: with PAM_SQLITE3_PRELOAD naming services, a host that loads the
+ * module before it forks (LD_PRELOAD) builds their profiles up front, and
+ * its children inherit them ready to use.
+ */
+static void __attribute__((constructor))
+preload_profiles(void)
+{
+	const char *env = getenv(PRELOAD_ENV);
+	char *list, *service, *save;
 
-	res = sqlite3_prepare(conn, query, MAX_ZSQL, &vm, &tail);
+	pthread_atfork(profiles_prefork, profiles_postfork, profiles_postfork);
+	if (!env || !(list = strdup(env)))
+		return;
+	for (service = strtok_r(list, ", ", &save); service;
+			service = strtok_r(NULL, ", ", &save))
+		preload_service(service);
+	free(list);
+}
 
-	free(query);
+/* private: release every cached profile when the module is unloaded */
+static void __attribute__((destructor))
+free_profiles(void)
+{
+	struct profile *p;
+	int i;
 
-	if (res != SQLITE_OK) {
-        errtext = sqlite3_errmsg(conn);
-		DBGLOG("Error executing SQLite query (%s)", errtext);
-		rc = PAM_AUTH_ERR;
-		goto done;
+	pthread_mutex_lock(&profiles_lock);
+	for (i = 0; i < PROFILE_BUCKETS; i++) {
+		while ((p = profiles[i])) {
+			profiles[i] = p->next;
+			if (--p->refs == 0)
+				profile_free(p);
+		}
 	}
+	pthread_mutex_unlock(&profiles_lock);
+}
 
-	if (SQLITE_ROW != sqlite3_step(vm)) {
-		rc = PAM_USER_UNKNOWN;
-		DBGLOG("no rows to retrieve");
-	} else {
-		const char *stored_pw = (const char *) sqlite3_column_text(vm, 0);
+/* private: microseconds since a CLOCK_MONOTONIC time */
+static uint64_t
+elapsed_us(const struct timespec *since)
+{
+	struct timespec now;
 
-		if (!stored_pw) {
-			SYSLOG("sqlite3 failed to return row data");
-			rc = PAM_AUTH_ERR;
-			goto done;
-		}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)(now.tv_sec - since->tv_sec) * 1000000 +
+		(now.tv_nsec - since->tv_nsec) / 1000;
+}
 
-		switch(options->pw_type) {
-		case PW_CLEAR:
-			if(strcmp(passwd, stored_pw) == 0)
-				rc = PAM_SUCCESS;
-			break;
-#if HAVE_MD5_CRYPT
-		case PW_MD5:
-#endif
-#if HAVE_SHA256_CRYPT
-		case PW_SHA256:
-#endif
-#if HAVE_SHA512_CRYPT
-		case PW_SHA512:
-#endif
-		case PW_CRYPT:
-			encrypted_pw = crypt(passwd, stored_pw);
-			if (!encrypted_pw) {
-				SYSLOG("crypt failed when encrypting password");
-				rc = PAM_AUTH_ERR;
-				goto done;
-			}
+/*
+ * private: queue an audit record and append a trace record for a call
+ * that began at start, spent setup microseconds finding its profile and
+ * conv waiting on the conversation.
+ */
+static void
+record_call(struct profile *profile, const char *op, const char *user, int rc,
+	const struct timespec *start, uint64_t setup, uint64_t conv)
+{
+	uint64_t total;
 
-			if(strcmp(encrypted_pw, stored_pw) == 0)
-				rc = PAM_SUCCESS;
-			break;
-		}
-	}
+	if (!profile)
+		return;
+	total = elapsed_us(start);
+	trail_record(profile->ctx, op, user, rc, total);
+	trace_record(profile->ctx, op, user, rc, total, setup, conv);
+}
 
-done:
-	sqlite3_finalize(vm);
-	sqlite3_close(conn);
-	return rc;
+/* private: the service a profile serves, for the probes */
+#define PROBE_SERVICE(profile)	((profile) ? (profile)->ctx->options->service : NULL)
+
+/* private: map an engine result onto the PAM return code */
+static int
+pam_result(int rc)
+{
+	switch (rc) {
+		case P3AUTH_SUCCESS:			return PAM_SUCCESS;
+		case P3AUTH_USER_UNKNOWN:		return PAM_USER_UNKNOWN;
+		case P3AUTH_ACCT_EXPIRED:		return PAM_ACCT_EXPIRED;
+		case P3AUTH_NEW_AUTHTOK_REQD:	return PAM_NEW_AUTHTOK_REQD;
+		case P3AUTH_AUTHINFO_UNAVAIL:	return PAM_AUTHINFO_UNAVAIL;
+		case P3AUTH_BUF_ERR:			return PAM_BUF_ERR;
+		case P3AUTH_PERM_DENIED:		return PAM_PERM_DENIED;
+		case P3AUTH_AUTHTOK_ERR:		return PAM_AUTHTOK_ERR;
+	}
+	return PAM_AUTH_ERR;
 }
 
 /* public: authenticate user */
 PAM_EXTERN int
 pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv)
 {
-	struct module_options *options = NULL;
+	struct profile *profile;
+	p3auth_ctx *ctx;
+	p3auth_lookup *lookup = NULL;
+	struct module_options *options;
 	const char *user = NULL, *password = NULL, *service = NULL;
+	const void *item = NULL;
+	struct timespec start, asked;
+	uint64_t setup, conv = 0;
 	int rc, std_flags;
 
-	std_flags = get_module_options(argc, argv, &options);
-	if(options_valid(options) != 0) {
+	PROBE(authenticate__start);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	profile = get_profile(pamh, argc, argv);
+	setup = elapsed_us(&start);
+	if(!profile) {
 		rc = PAM_AUTH_ERR;
 		goto done;
 	}
+	ctx = profile->ctx;
+	std_flags = profile->std_flags;
+	options = ctx->options;
 
 	if((rc = pam_get_user(pamh, &user, NULL)) != PAM_SUCCESS) {
 		SYSLOG("failed to get username from pam");
@@ -643,18 +469,39 @@ pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv)
 
 	DBGLOG("attempting to authenticate: %s", user);
 
-	if((rc = pam_get_pass(pamh, &password, PASSWORD_PROMPT, std_flags)
-		!= PAM_SUCCESS)) {
+	/*
+	 * Look the user up while the conversation waits for the password,
+	 * unless a stacked module has already supplied it.
+	 */
+	if(!(std_flags & (PAM_OPT_TRY_FIRST_PASS | PAM_OPT_USE_FIRST_PASS)) ||
+			pam_get_item(pamh, PAM_AUTHTOK, &item) != PAM_SUCCESS || !item) {
+		if(!options->no_prefetch)
+			lookup = p3auth_lookup_start(ctx, user);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &asked);
+	rc = pam_get_pass(pamh, &password, PASSWORD_PROMPT, std_flags);
+	conv = elapsed_us(&asked);
+	if(rc != PAM_SUCCESS)
 		goto done;
+
+	if(lookup) {
+		rc = p3auth_lookup_verify(lookup, password);
+		lookup = NULL;
+	} else {
+		rc = p3auth_verify_password(ctx, user, password);
 	}
 
-	if((rc = auth_verify_password(user, password, options)) != PAM_SUCCESS)
+	if((rc = pam_result(rc)) != PAM_SUCCESS)
 		SYSLOG("(%s) user %s not authenticated.", pam_get_service(pamh, &service), user);
 	else
 		SYSLOG("(%s) user %s authenticated.", pam_get_service(pamh, &service), user);
 
 done:
-	free_module_options(options);
+	p3auth_lookup_cancel(lookup);
+	record_call(profile, "authenticate", user, rc, &start, setup, conv);
+	PROBE3(authenticate__done, PROBE_SERVICE(profile), PROBE_USER(user), rc);
+	put_profile(profile);
 	return rc;
 }
 
@@ -663,24 +510,29 @@ PAM_EXTERN int
 pam_sm_acct_mgmt(pam_handle_t *pamh, int flags, int argc,
 							const char **argv)
 {
-	struct module_options *options = NULL;
-	const char *user = NULL;
+	struct profile *profile;
+	p3auth_ctx *ctx;
+	struct module_options *options;
+	const char *user = NULL, *service = NULL;
+	const void *rhost = NULL;
+	struct timespec start;
+	uint64_t setup;
 	int rc = PAM_AUTH_ERR;
-	sqlite3 *conn = NULL;
-	sqlite3_stmt *vm = NULL;
-	char *query = NULL;
-	const char *tail = NULL;
-	const char *errtext = NULL;
-	int res;
-
-	get_module_options(argc, argv, &options);
-	if(options_valid(options) != 0) {
+
+	PROBE(acct_mgmt__start);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	profile = get_profile(pamh, argc, argv);
+	setup = elapsed_us(&start);
+	if(!profile) {
 		rc = PAM_AUTH_ERR;
 		goto done;
 	}
+	ctx = profile->ctx;
+	options = ctx->options;
 
-	/* both not specified, just succeed. */
-	if(options->expired_column == NULL && options->newtok_column == NULL) {
+	/* nothing to check, just succeed. */
+	if(options->expired_column == NULL && options->newtok_column == NULL &&
+			options->sql_check_group == NULL && options->sql_check_host == NULL) {
 		rc = PAM_SUCCESS;
 		goto done;
 	}
@@ -690,87 +542,18 @@ pam_sm_acct_mgmt(pam_handle_t *pamh, int flags, int argc,
 		goto done;
 	}
 
-	if(!(conn = pam_sqlite3_connect(options))) {
-		SYSLOGERR("could not connect to database");
-		rc = PAM_AUTH_ERR;
+	if((rc = pam_result(p3auth_check_account(ctx, user))) != PAM_SUCCESS)
 		goto done;
-	}
-
-	/* if account has expired then expired_column = '1' or 'y' */
-	if(options->expired_column || options->sql_check_expired) {
-
-		if(!(query = format_query(options->sql_check_expired ? options->sql_check_expired :
-				"SELECT 1 from %Ot WHERE %Ou='%U' AND (%Ox='y' OR %Ox='1')",
-				options, user, NULL))) {
-			SYSLOGERR("failed to construct sql query");
-			rc = PAM_AUTH_ERR;
-			goto done;
-		}
-
-		DBGLOG("query: %s", query);
-
-		res = sqlite3_prepare(conn, query, MAX_ZSQL, &vm, &tail);
-
-		free(query);
-
-		if (res != SQLITE_OK) {
-            errtext = sqlite3_errmsg(conn);
-			SYSLOGERR("Error executing SQLite query (%s)", errtext);
-			rc = PAM_AUTH_ERR;
-			goto done;
-		}
-
-		res = sqlite3_step(vm);
-
-		DBGLOG("query result: %d", res);
-
-		if(SQLITE_ROW == res) {
-			rc = PAM_ACCT_EXPIRED;
-			goto done;
-		}
-		sqlite3_finalize(vm);
-		vm = NULL;
-	}
-
-	/* if new password is required then newtok_column = 'y' or '1' */
-	if(options->newtok_column || options->sql_check_newtok) {
-		if(!(query = format_query(options->sql_check_newtok ? options->sql_check_newtok :
-				"SELECT 1 FROM %Ot WHERE %Ou='%U' AND (%On='y' OR %On='1')",
-				options, user, NULL))) {
-			SYSLOGERR("failed to construct sql query");
-			rc = PAM_AUTH_ERR;
-			goto done;
-		}
-
-		DBGLOG("query: %s", query);
 
-		res = sqlite3_prepare(conn, query, MAX_ZSQL, &vm, &tail);
-		free(query);
-
-		if (res != SQLITE_OK) {
-            errtext = sqlite3_errmsg(conn);
-			SYSLOGERR("query failed: %s", errtext);
-			rc = PAM_AUTH_ERR;
-			goto done;
-		}
-
-		res = sqlite3_step(vm);
-
-		if(SQLITE_ROW == res) {
-			rc = PAM_NEW_AUTHTOK_REQD;
-			goto done;
-		}
-		sqlite3_finalize(vm);
-		vm = NULL;
-	}
-
-	rc = PAM_SUCCESS;
+	if(pam_get_item(pamh, PAM_RHOST, &rhost) != PAM_SUCCESS)
+		rhost = NULL;
+	if((rc = pam_result(p3auth_check_access(ctx, user, rhost))) == PAM_PERM_DENIED)
+		SYSLOG("(%s) user %s not allowed access.", pam_get_service(pamh, &service), user);
 
 done:
-	/* Do all cleanup in one place. */
-	sqlite3_finalize(vm);
-	sqlite3_close(conn);
-	free_module_options(options);
+	record_call(profile, "acct_mgmt", user, rc, &start, setup, 0);
+	PROBE3(acct_mgmt__done, PROBE_SERVICE(profile), PROBE_USER(user), rc);
+	put_profile(profile);
 	return rc;
 }
 
@@ -778,21 +561,26 @@ done:
 PAM_EXTERN int
 pam_sm_chauthtok(pam_handle_t *pamh, int flags, int argc, const char **argv)
 {
-	struct module_options *options = NULL;
+	struct profile *profile;
+	p3auth_ctx *ctx;
+	struct module_options *options;
 	int rc = PAM_AUTH_ERR;
 	int std_flags;
 	const char *user = NULL, *pass = NULL, *newpass = NULL, *service = NULL;
-	char *newpass_crypt = NULL;
-	sqlite3 *conn = NULL;
-	char *errtext = NULL;
-	char *query = NULL;
-	int res;
-
-	std_flags = get_module_options(argc, argv, &options);
-	if(options_valid(options) != 0) {
+	struct timespec start, asked;
+	uint64_t setup, conv = 0;
+
+	PROBE1(chauthtok__start, flags & PAM_PRELIM_CHECK ? 1 : 0);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	profile = get_profile(pamh, argc, argv);
+	setup = elapsed_us(&start);
+	if(!profile) {
 		rc = PAM_AUTH_ERR;
 		goto done;
 	}
+	ctx = profile->ctx;
+	std_flags = profile->std_flags;
+	options = ctx->options;
 
 	if((rc = pam_get_user(pamh, &user, NULL)) != PAM_SUCCESS) {
 		SYSLOGERR("could not retrieve user");
@@ -801,8 +589,11 @@ pam_sm_chauthtok(pam_handle_t *pamh, int flags, int argc, const char **argv)
 
 	if(flags & PAM_PRELIM_CHECK) {
 		/* at this point, this is the first time we get called */
-		if((rc = pam_get_pass(pamh, &pass, PASSWORD_PROMPT, std_flags)) == PAM_SUCCESS) {
-			if((rc = auth_verify_password(user, pass, options)) == PAM_SUCCESS) {
+		clock_gettime(CLOCK_MONOTONIC, &asked);
+		rc = pam_get_pass(pamh, &pass, PASSWORD_PROMPT, std_flags);
+		conv = elapsed_us(&asked);
+		if(rc == PAM_SUCCESS) {
+			if((rc = pam_result(p3auth_verify_password(ctx, user, pass))) == PAM_SUCCESS) {
 				rc = pam_set_item(pamh, PAM_OLDAUTHTOK, (const void *)pass);
 				if(rc != PAM_SUCCESS) {
 					SYSLOGERR("failed to set PAM_OLDAUTHTOK!");
@@ -822,14 +613,16 @@ pam_sm_chauthtok(pam_handle_t *pamh, int flags, int argc, const char **argv)
 			SYSLOGERR("could not retrieve old token");
 			goto done;
 		}
-		rc = auth_verify_password(user, pass, options);
+		rc = pam_result(p3auth_verify_password(ctx, user, pass));
 		if(rc != PAM_SUCCESS) {
 			SYSLOG("(%s) user '%s' not authenticated.", pam_get_service(pamh, &service), user);
 			goto done;
 		}
 
 		/* get and confirm the new passwords */
+		clock_gettime(CLOCK_MONOTONIC, &asked);
 		rc = pam_get_confirm_pass(pamh, &newpass, PASSWORD_PROMPT_NEW, PASSWORD_PROMPT_CONFIRM, std_flags);
+		conv = elapsed_us(&asked);
 		if(rc != PAM_SUCCESS) {
 			SYSLOGERR("could not retrieve new authentication tokens");
 			goto done;
@@ -843,55 +636,136 @@ pam_sm_chauthtok(pam_handle_t *pamh, int flags, int argc, const char **argv)
 		}
 
 		/* update the database */
-		if(!(newpass_crypt = encrypt_password(options, newpass))) {
-			SYSLOGERR("passwd encrypt failed");
-			rc = PAM_BUF_ERR;
-			goto done;
-		}
-		if(!(conn = pam_sqlite3_connect(options))) {
-			SYSLOGERR("could not connect to database");
-			rc = PAM_AUTHINFO_UNAVAIL;
+		DBGLOG("updating password for %s", user);
+		if((rc = pam_result(p3auth_set_password(ctx, user, newpass))) != PAM_SUCCESS)
 			goto done;
-		}
 
-		DBGLOG("creating query");
+		/* if we get here, we must have succeeded */
+	}
 
-		if(!(query = format_query(options->sql_set_passwd ? options->sql_set_passwd :
-				"UPDATE %Ot SET %Op='%P' WHERE %Ou='%U'",
-				options, user, newpass_crypt))) {
-			SYSLOGERR("failed to construct sql query");
-			rc = PAM_AUTH_ERR;
-			goto done;
-		}
+	SYSLOG("(%s) password for '%s' was changed.", pam_get_service(pamh, &service), user);
+	rc = PAM_SUCCESS;
 
-		DBGLOG("query: %s", query);
+done:
+	record_call(profile, (flags & PAM_PRELIM_CHECK) ? "chauthtok-prelim" :
+		"chauthtok", user, rc, &start, setup, conv);
+	PROBE4(chauthtok__done, PROBE_SERVICE(profile), PROBE_USER(user), rc,
+		flags & PAM_PRELIM_CHECK ? 1 : 0);
+	put_profile(profile);
+	return rc;
+}
 
-		res = sqlite3_exec(conn, query, NULL, NULL, &errtext);
-		free(query);
+/* private: what pam_sm_open_session() leaves for pam_sm_close_session() */
+struct session_data {
+	struct profile *profile;	/* held until the session ends */
+	char *user;
+	unsigned long long id;
+	pid_t pid;					/* that opened the session */
+	int closed;
+};
 
-		if (SQLITE_OK != res) {
-			SYSLOGERR("query failed[%d]: %s", res, errtext);
-            sqlite3_free(errtext);  // error strings rom sqlite3_exec must be freed
-			rc = PAM_AUTH_ERR;
-			goto done;
-		}
+/* private: end a session once, in the process that opened it */
+static void
+session_end(struct session_data *s)
+{
+	if (!s->closed && s->pid == getpid())
+		p3auth_close_session(s->profile->ctx, s->user, s->id);
+	s->closed = 1;
+}
 
-		/* if we get here, we must have succeeded */
+/*
+ * private: pam_end() without pam_sm_close_session() still ends the
+ * session, unless it is a forked child letting go (PAM_DATA_SILENT)
+ */
+static void
+session_cleanup(pam_handle_t *pamh, void *data, int error_status)
+{
+	struct session_data *s = data;
+
+	if (!(error_status & PAM_DATA_SILENT))
+		session_end(s);
+	put_profile(s->profile);
+	free(s->user);
+	free(s);
+}
+
+/*
+ * public: open a session, refused with PAM_PERM_DENIED if the user already
+ * has max_sessions.  A pre-forking host can also call it once before
+ * forking to have its children start warm.
+ */
+PAM_EXTERN int
+pam_sm_open_session(pam_handle_t *pamh, int flags, int argc, const char **argv)
+{
+	struct profile *profile;
+	p3auth_ctx *ctx;
+	struct module_options *options;
+	struct session_data *s = NULL;
+	const char *user = NULL, *service = NULL;
+	const void *tty = NULL, *rhost = NULL;
+	unsigned long long id;
+	int rc;
+
+	if (!(profile = get_profile(pamh, argc, argv)))
+		return PAM_SUCCESS;
+	ctx = profile->ctx;
+	options = ctx->options;
+	p3auth_warm(ctx);
+	if (options->max_sessions <= 0 && !options->session_table) {
+		rc = PAM_SUCCESS;
+		goto done;
 	}
 
-	SYSLOG("(%s) password for '%s' was changed.", pam_get_service(pamh, &service), user);
-	rc = PAM_SUCCESS;
+	if ((rc = pam_get_user(pamh, &user, NULL)) != PAM_SUCCESS) {
+		SYSLOGERR("could not retrieve user");
+		goto done;
+	}
+	if (pam_get_item(pamh, PAM_TTY, &tty) != PAM_SUCCESS)
+		tty = NULL;
+	if (pam_get_item(pamh, PAM_RHOST, &rhost) != PAM_SUCCESS)
+		rhost = NULL;
+	if ((rc = pam_result(p3auth_open_session(ctx, user, tty, rhost, &id))) != PAM_SUCCESS) {
+		SYSLOG("(%s) user %s has too many sessions.", pam_get_service(pamh, &service), user);
+		goto done;
+	}
+
+	if (!(s = calloc(1, sizeof(*s))) || !(s->user = strdup(user))) {
+		p3auth_close_session(ctx, user, id);
+		free(s);
+		rc = PAM_BUF_ERR;
+		goto done;
+	}
+	s->profile = profile;
+	s->id = id;
+	s->pid = getpid();
+	if (pam_set_data(pamh, SESSION_DATA, s, session_cleanup) != PAM_SUCCESS) {
+		session_end(s);
+		free(s->user);
+		free(s);
+		rc = PAM_SESSION_ERR;
+		goto done;
+	}
+	return PAM_SUCCESS;		/* the profile now belongs to the session */
 
 done:
-	/* Do all cleanup in one place. */
-	sqlite3_close(conn);
-	if (newpass_crypt != NULL)
-		memzero_explicit(newpass_crypt, strlen(newpass_crypt));
-	free(newpass_crypt);
-	free_module_options(options);
+	put_profile(profile);
 	return rc;
 }
 
+/* public: close the session pam_sm_open_session() counted */
+PAM_EXTERN int
+pam_sm_close_session(pam_handle_t *pamh, int flags, int argc, const char **argv)
+{
+	const void *data = NULL;
+
+	if (pam_get_data(pamh, SESSION_DATA, &data) != PAM_SUCCESS || !data)
+		return PAM_SUCCESS;
+	session_end((struct session_data *)data);
+	/* runs session_cleanup(), which lets go of the profile */
+	pam_set_data(pamh, SESSION_DATA, NULL, NULL);
+	return PAM_SUCCESS;
+}
+
 /* public: just succeed. */
 PAM_EXTERN int
 pam_sm_setcred(pam_handle_t *pamh, int flags, int argc, const char **argv)
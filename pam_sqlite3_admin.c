@@ -0,0 +1,1168 @@
+/*
+ * pam_sqlite3-admin: bulk provisioning and rehash tool for pam_sqlite3
+ *
+ * Uses the module's own option parsing and hashing code, so a table
+ * provisioned with this tool verifies exactly the way the module expects.
+ * Hashing is spread over a work-stealing thread pool and the results are
+ * written back in large transactions.  Every transaction also records how
+ * far the job got, so an interrupted run picks up where it left off.
+ *
+ * This file is part of pam_sqlite3, see pam_sqlite3.c for copyright and
+ * licensing information.
+ */
+
+#include "pam_sqlite3_int.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#define DEFAULT_BATCH	10000
+#define STEAL_CHUNK		4
+#define BUSY_TIMEOUT	5000
+#define STATE_TABLE		"pam_sqlite3_admin_state"
+#define VERIFY_TABLE	"pam_sqlite3_verify"
+
+/* maintain: how often it looks at the load, and how long it waits */
+#define MAINTAIN_TICK_MS	1000
+#define MAINTAIN_BACKOFF_MS	30000	/* the longest wait while busy */
+#define MAINTAIN_IDLE_RATE	2		/* default -i, database uses per second */
+#define MAINTAIN_BUSY_MS	50		/* lock wait before a slice gives up */
+#define CHORE_RETRY			60		/* seconds before a failed slice is retried */
+
+/* maintain: seconds between rounds of each chore, and the size of a slice */
+#define CHECKPOINT_EVERY	10
+#define CHANGELOG_EVERY		600
+#define CHANGELOG_KEEP		86400	/* seconds a change stays logged */
+#define CHANGELOG_SLICE		500		/* rows */
+#define VACUUM_EVERY		600
+#define VACUUM_SLICE		64		/* pages */
+#define OPTIMIZE_EVERY		3600
+#define ANALYZE_EVERY		86400
+
+struct item {
+	char *user;
+	char *pass;
+	sqlite3_int64 rowid;
+	char *hash;
+};
+
+/* a contiguous run of the current batch owned by one worker */
+struct deque {
+	pthread_mutex_t lock;
+	size_t head, tail;
+};
+
+struct pool {
+	int nthreads;
+	pthread_t *threads;
+	struct deque *queues;
+	struct module_options *options;
+
+	pthread_mutex_t lock;
+	pthread_cond_t work, done;
+	struct item *items;
+	unsigned long generation;
+	int busy;
+	int stop;
+	unsigned long failed;
+};
+
+struct worker {
+	struct pool *pool;
+	int id;
+};
+
+static int quiet;
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"usage: pam_sqlite3-admin [-c config_file] [-s service] [-o option=value ...]\n"
+		"                         [-j threads] [-b batch_size] [-i rate] [-r] [-q] command\n"
+		"\n"
+		"commands:\n"
+		"    import FILE   add or update users from a CSV file of user,password\n"
+		"                  lines, hashing each password with pw_type\n"
+		"    rehash        hash clear text passwords already in the table with\n"
+		"                  pw_type, in place\n"
+		"    verify FILE   check the user,password lines of a CSV file against\n"
+		"                  the table\n"
+		"    stats         show the host-wide admission control counters\n"
+		"    changelog [TABLE:COLUMN ...]\n"
+		"                  create changelog_table and the triggers that log\n"
+		"                  changes to the user table and to each TABLE, whose\n"
+		"                  COLUMN holds user names\n"
+		"    maintain      until stopped, checkpoint the WAL, prune changelog_table,\n"
+		"                  run incremental_vacuum, PRAGMA optimize and ANALYZE in\n"
+		"                  small slices whenever logins leave the database quiet\n"
+		"\n"
+		"    -s service    apply the config file's [service] section\n"
+		"    -i rate       maintain: quiet means fewer database uses a second\n"
+		"                  than this by the module, host-wide (default 2)\n"
+		"    -r            ignore any saved progress and start from the beginning\n"
+		"    -q            do not report progress\n");
+	exit(2);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* take the next few items from our own run, returns 0 when it is empty */
+static int
+pool_take(struct deque *q, size_t *lo, size_t *hi)
+{
+	int found = 0;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->head < q->tail) {
+		*lo = q->head;
+		q->head += STEAL_CHUNK;
+		if (q->head > q->tail)
+			q->head = q->tail;
+		*hi = q->head;
+		found = 1;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return found;
+}
+
+/* move the back half of the fullest other run into ours */
+static int
+pool_steal(struct pool *pool, int self)
+{
+	struct deque *victim = NULL, *mine = &pool->queues[self];
+	size_t best = 0, left, mid;
+	int i;
+
+	for (i = 1; i < pool->nthreads; i++) {
+		struct deque *q = &pool->queues[(self + i) % pool->nthreads];
+
+		/* racy peek, only used to pick a victim */
+		left = q->tail - q->head;
+		if (q->head < q->tail && left > best) {
+			best = left;
+			victim = q;
+		}
+	}
+	if (!victim)
+		return 0;
+
+	pthread_mutex_lock(&victim->lock);
+	if (victim->head >= victim->tail) {
+		pthread_mutex_unlock(&victim->lock);
+		return 1;	/* lost the race, look again */
+	}
+	mid = victim->head + (victim->tail - victim->head + 1) / 2;
+	pthread_mutex_lock(&mine->lock);
+	mine->head = mid;
+	mine->tail = victim->tail;
+	pthread_mutex_unlock(&mine->lock);
+	victim->tail = mid;
+	pthread_mutex_unlock(&victim->lock);
+	return 1;
+}
+
+static void *
+pool_worker(void *arg)
+{
+	struct worker *w = arg;
+	struct pool *pool = w->pool;
+	struct crypt_data *data;
+	unsigned long seen = 0, failed;
+	size_t lo, hi;
+
+	if (!(data = calloc(1, sizeof(*data)))) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		while (!pool->stop && pool->generation == seen)
+			pthread_cond_wait(&pool->work, &pool->lock);
+		if (pool->stop) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		seen = pool->generation;
+		pthread_mutex_unlock(&pool->lock);
+
+		failed = 0;
+		for (;;) {
+			while (pool_take(&pool->queues[w->id], &lo, &hi)) {
+				for (; lo < hi; lo++) {
+					struct item *it = &pool->items[lo];
+
+					it->hash = encrypt_password_r(pool->options, it->pass, data);
+					if (!it->hash)
+						failed++;
+				}
+			}
+			if (!pool_steal(pool, w->id))
+				break;
+		}
+
+		pthread_mutex_lock(&pool->lock);
+		pool->failed += failed;
+		if (--pool->busy == 0)
+			pthread_cond_signal(&pool->done);
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	memzero_explicit(data, sizeof(*data));
+	free(data);
+	free(w);
+	return NULL;
+}
+
+static struct pool *
+pool_create(struct module_options *options, int nthreads)
+{
+	struct pool *pool;
+	int i;
+
+	if (!(pool = calloc(1, sizeof(*pool))) ||
+		!(pool->threads = calloc(nthreads, sizeof(*pool->threads))) ||
+		!(pool->queues = calloc(nthreads, sizeof(*pool->queues)))) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	pool->nthreads = nthreads;
+	pool->options = options;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	for (i = 0; i < nthreads; i++) {
+		struct worker *w = malloc(sizeof(*w));
+
+		if (!w) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+		w->pool = pool;
+		w->id = i;
+		pthread_mutex_init(&pool->queues[i].lock, NULL);
+		if ((errno = pthread_create(&pool->threads[i], NULL, pool_worker, w))) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	return pool;
+}
+
+/* hash items[0..n) on all workers, returns the number of failures */
+static unsigned long
+pool_run(struct pool *pool, struct item *items, size_t n)
+{
+	unsigned long failed;
+	size_t per = n / pool->nthreads, extra = n % pool->nthreads, at = 0;
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	for (i = 0; i < pool->nthreads; i++) {
+		pool->queues[i].head = at;
+		at += per + (i < extra ? 1 : 0);
+		pool->queues[i].tail = at;
+	}
+	pool->items = items;
+	pool->failed = 0;
+	pool->busy = pool->nthreads;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->work);
+	while (pool->busy)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	failed = pool->failed;
+	pthread_mutex_unlock(&pool->lock);
+	return failed;
+}
+
+static void
+pool_destroy(struct pool *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 0; i < pool->nthreads; i++)
+		pthread_join(pool->threads[i], NULL);
+	free(pool->threads);
+	free(pool->queues);
+	free(pool);
+}
+
+static void
+free_items(struct item *items, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		free(items[i].user);
+		if (items[i].pass) {
+			memzero_explicit(items[i].pass, strlen(items[i].pass));
+			free(items[i].pass);
+		}
+		secret_free(items[i].hash);
+	}
+	memset(items, 0, n * sizeof(*items));
+}
+
+static void
+db_fatal(sqlite3 *db, const char *what)
+{
+	fprintf(stderr, "%s: %s\n", what, sqlite3_errmsg(db));
+	exit(1);
+}
+
+static sqlite3_stmt *
+db_prepare(sqlite3 *db, const char *fmt, ...)
+{
+	sqlite3_stmt *vm;
+	va_list ap;
+	char *sql;
+
+	va_start(ap, fmt);
+	sql = sqlite3_vmprintf(fmt, ap);
+	va_end(ap);
+	if (!sql) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	if (sqlite3_prepare_v2(db, sql, -1, &vm, NULL) != SQLITE_OK) {
+		fprintf(stderr, "%s\n", sql);
+		db_fatal(db, "prepare failed");
+	}
+	sqlite3_free(sql);
+	return vm;
+}
+
+static void
+db_exec(sqlite3 *db, const char *sql)
+{
+	if (sqlite3_exec(db, sql, NULL, NULL, NULL) != SQLITE_OK)
+		db_fatal(db, sql);
+}
+
+/* db_exec() a statement built from fmt with sqlite3_mprintf() */
+static void
+db_execf(sqlite3 *db, const char *fmt, ...)
+{
+	va_list ap;
+	char *sql;
+
+	va_start(ap, fmt);
+	sql = sqlite3_vmprintf(fmt, ap);
+	va_end(ap);
+	if (!sql) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	db_exec(db, sql);
+	sqlite3_free(sql);
+}
+
+/* saved progress for a job, or 0 when starting fresh */
+static sqlite3_int64
+state_load(sqlite3 *db, const char *job)
+{
+	sqlite3_stmt *vm;
+	sqlite3_int64 pos = 0;
+
+	db_exec(db, "CREATE TABLE IF NOT EXISTS " STATE_TABLE
+		" (job TEXT PRIMARY KEY, position INTEGER NOT NULL)");
+	vm = db_prepare(db, "SELECT position FROM " STATE_TABLE " WHERE job=?");
+	sqlite3_bind_text(vm, 1, job, -1, SQLITE_STATIC);
+	if (sqlite3_step(vm) == SQLITE_ROW)
+		pos = sqlite3_column_int64(vm, 0);
+	sqlite3_finalize(vm);
+	return pos;
+}
+
+static void
+state_save(sqlite3_stmt *vm, const char *job, sqlite3_int64 pos)
+{
+	sqlite3_bind_text(vm, 1, job, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(vm, 2, pos);
+	if (sqlite3_step(vm) != SQLITE_DONE)
+		db_fatal(sqlite3_db_handle(vm), "saving progress failed");
+	sqlite3_reset(vm);
+}
+
+static void
+state_clear(sqlite3 *db, const char *job)
+{
+	sqlite3_stmt *vm;
+
+	vm = db_prepare(db, "DELETE FROM " STATE_TABLE " WHERE job=?");
+	sqlite3_bind_text(vm, 1, job, -1, SQLITE_STATIC);
+	sqlite3_step(vm);
+	sqlite3_finalize(vm);
+}
+
+static void
+progress(const char *job, unsigned long rows, double started, int final)
+{
+	double elapsed = now() - started;
+
+	if (quiet && !final)
+		return;
+	fprintf(stderr, "\r%s: %lu rows, %.1fs, %.0f rows/s%s", job, rows,
+		elapsed, elapsed > 0 ? rows / elapsed : 0.0, final ? "\n" : "");
+}
+
+/*
+ * Parse one CSV field starting at *p.  Handles double quoted fields with
+ * "" escapes; returns a malloc'd copy and advances *p past the separator.
+ */
+static char *
+csv_field(char **p)
+{
+	char *src = *p, *out, *dst;
+
+	if (!(out = malloc(strlen(src) + 1)))
+		return NULL;
+	dst = out;
+	if (*src == '"') {
+		for (src++; *src; src++) {
+			if (*src == '"') {
+				if (src[1] != '"') {
+					src++;
+					break;
+				}
+				src++;
+			}
+			*dst++ = *src;
+		}
+	}
+	while (*src && *src != ',' && *src != '\n' && *src != '\r')
+		*dst++ = *src++;
+	*dst = '\0';
+	*p = *src == ',' ? src + 1 : src;
+	return out;
+}
+
+/* read up to max user,password lines; blank lines and #comments are skipped */
+static size_t
+csv_read_batch(FILE *fp, struct item *items, size_t max, unsigned long *lineno)
+{
+	char line[4096], *p;
+	size_t n = 0;
+
+	while (n < max && fgets(line, sizeof(line), fp)) {
+		(*lineno)++;
+		if (line[0] == '#' || line[0] == '\n' || line[0] == '\r')
+			continue;
+		p = line;
+		items[n].user = csv_field(&p);
+		items[n].pass = csv_field(&p);
+		if (!items[n].user || !items[n].pass || !*items[n].user) {
+			fprintf(stderr, "\nline %lu: expected user,password\n", *lineno);
+			exit(1);
+		}
+		n++;
+	}
+	memzero_explicit(line, sizeof(line));
+	return n;
+}
+
+static int
+cmd_import(sqlite3 *db, struct module_options *options, struct pool *pool,
+	size_t batch, const char *file, int restart)
+{
+	struct item *items;
+	sqlite3_stmt *upd, *ins, *save;
+	unsigned long rows = 0, failed = 0, lineno = 0;
+	char job[PATH_MAX + 8], path[PATH_MAX];
+	sqlite3_int64 pos;
+	double started = now();
+	size_t n, i;
+	FILE *fp;
+
+	if (!(fp = fopen(file, "r")) || !realpath(file, path)) {
+		perror(file);
+		return 1;
+	}
+	snprintf(job, sizeof(job), "import:%s", path);
+
+	pos = restart ? 0 : state_load(db, job);
+	if (pos > 0) {
+		if (!quiet)
+			fprintf(stderr, "%s: resuming at byte %lld\n", job, (long long)pos);
+		if (fseeko(fp, pos, SEEK_SET) != 0) {
+			perror(file);
+			return 1;
+		}
+	}
+
+	upd = db_prepare(db, "UPDATE %s SET %s=? WHERE %s=?",
+		options->table, options->pwd_column, options->user_column);
+	ins = db_prepare(db, "INSERT INTO %s (%s, %s) VALUES (?, ?)",
+		options->table, options->user_column, options->pwd_column);
+	save = db_prepare(db, "INSERT OR REPLACE INTO " STATE_TABLE " VALUES (?, ?)");
+
+	if (!(items = calloc(batch, sizeof(*items)))) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	while ((n = csv_read_batch(fp, items, batch, &lineno)) > 0) {
+		failed += pool_run(pool, items, n);
+
+		db_exec(db, "BEGIN IMMEDIATE");
+		for (i = 0; i < n; i++) {
+			if (!items[i].hash)
+				continue;
+			sqlite3_bind_text(upd, 1, items[i].hash, -1, SQLITE_STATIC);
+			sqlite3_bind_text(upd, 2, items[i].user, -1, SQLITE_STATIC);
+			if (sqlite3_step(upd) != SQLITE_DONE)
+				db_fatal(db, "update failed");
+			sqlite3_reset(upd);
+			if (sqlite3_changes(db) > 0)
+				continue;
+			sqlite3_bind_text(ins, 1, items[i].user, -1, SQLITE_STATIC);
+			sqlite3_bind_text(ins, 2, items[i].hash, -1, SQLITE_STATIC);
+			if (sqlite3_step(ins) != SQLITE_DONE)
+				db_fatal(db, "insert failed");
+			sqlite3_reset(ins);
+		}
+		state_save(save, job, ftello(fp));
+		db_exec(db, "COMMIT");
+
+		free_items(items, n);
+		rows += n;
+		progress(job, rows, started, 0);
+	}
+
+	if (ferror(fp)) {
+		perror(file);
+		return 1;
+	}
+	state_clear(db, job);
+	progress(job, rows, started, 1);
+	if (failed)
+		fprintf(stderr, "%lu passwords could not be hashed and were skipped\n", failed);
+
+	sqlite3_finalize(upd);
+	sqlite3_finalize(ins);
+	sqlite3_finalize(save);
+	free(items);
+	fclose(fp);
+	return failed ? 1 : 0;
+}
+
+/*
+ * Check a CSV file of user,password lines against the table, a batch per
+ * query: the batch goes into a temporary table and one join with
+ * pam_verify() checks every row of it.  Prints user,ok|wrong|unknown.
+ */
+static int
+cmd_verify(sqlite3 *db, struct module_options *options, size_t batch,
+	const char *file)
+{
+	struct item *items;
+	sqlite3_stmt *ins, *check;
+	unsigned long rows = 0, lineno = 0, wrong = 0, unknown = 0;
+	double started = now();
+	const char *user;
+	size_t n, i;
+	FILE *fp;
+
+	if (!(fp = fopen(file, "r"))) {
+		perror(file);
+		return 1;
+	}
+	register_sql_functions(db, options);
+	db_exec(db, "CREATE TEMP TABLE " VERIFY_TABLE " (user TEXT, pass TEXT)");
+	ins = db_prepare(db, "INSERT INTO temp." VERIFY_TABLE " VALUES (?, ?)");
+	check = db_prepare(db, "SELECT v.user, pam_verify(a.%s, v.pass) FROM temp."
+		VERIFY_TABLE " v LEFT JOIN %s a ON a.%s = v.user ORDER BY v.rowid",
+		options->pwd_column, options->table, options->user_column);
+
+	if (!(items = calloc(batch, sizeof(*items)))) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	while ((n = csv_read_batch(fp, items, batch, &lineno)) > 0) {
+		db_exec(db, "BEGIN");
+		for (i = 0; i < n; i++) {
+			sqlite3_bind_text(ins, 1, items[i].user, -1, SQLITE_STATIC);
+			sqlite3_bind_text(ins, 2, items[i].pass, -1, SQLITE_STATIC);
+			if (sqlite3_step(ins) != SQLITE_DONE)
+				db_fatal(db, "insert failed");
+			sqlite3_reset(ins);
+		}
+		while (sqlite3_step(check) == SQLITE_ROW) {
+			user = (const char *)sqlite3_column_text(check, 0);
+			if (sqlite3_column_type(check, 1) == SQLITE_NULL) {
+				printf("%s,unknown\n", user);
+				unknown++;
+			} else if (sqlite3_column_int(check, 1)) {
+				printf("%s,ok\n", user);
+			} else {
+				printf("%s,wrong\n", user);
+				wrong++;
+			}
+		}
+		sqlite3_reset(check);
+		/* the passwords never reach the database file */
+		db_exec(db, "DELETE FROM temp." VERIFY_TABLE);
+		db_exec(db, "COMMIT");
+
+		free_items(items, n);
+		rows += n;
+		progress("verify", rows, started, 0);
+	}
+
+	if (ferror(fp)) {
+		perror(file);
+		return 1;
+	}
+	progress("verify", rows, started, 1);
+	if (wrong || unknown)
+		fprintf(stderr, "%lu wrong passwords, %lu unknown users\n", wrong, unknown);
+
+	sqlite3_finalize(ins);
+	sqlite3_finalize(check);
+	free(items);
+	fclose(fp);
+	return wrong || unknown ? 1 : 0;
+}
+
+static int
+cmd_rehash(sqlite3 *db, struct module_options *options, struct pool *pool,
+	size_t batch, int restart)
+{
+	struct item *items;
+	sqlite3_stmt *sel, *upd, *save;
+	unsigned long rows = 0, skipped = 0, failed = 0;
+	char job[256];
+	sqlite3_int64 last;
+	double started = now();
+	size_t n, i;
+
+	if (options->pw_type == PW_CLEAR) {
+		fprintf(stderr, "rehash: pw_type is clear, nothing to do\n");
+		return 1;
+	}
+
+	/*
+	 * Only clear text can be rehashed.  Rows that already hold a modular
+	 * crypt hash ("$id$...", from an earlier interrupted run or another
+	 * scheme) are left alone, as are DES hashes when rehashing to crypt.
+	 */
+
+	snprintf(job, sizeof(job), "rehash:%s", options->table);
+	last = restart ? 0 : state_load(db, job);
+	if (last > 0 && !quiet)
+		fprintf(stderr, "%s: resuming after rowid %lld\n", job, (long long)last);
+
+	sel = db_prepare(db, "SELECT rowid, %s FROM %s WHERE rowid > ? ORDER BY rowid LIMIT ?",
+		options->pwd_column, options->table);
+	upd = db_prepare(db, "UPDATE %s SET %s=? WHERE rowid=?",
+		options->table, options->pwd_column);
+	save = db_prepare(db, "INSERT OR REPLACE INTO " STATE_TABLE " VALUES (?, ?)");
+
+	if (!(items = calloc(batch, sizeof(*items)))) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	for (;;) {
+		int scanned = 0;
+
+		sqlite3_bind_int64(sel, 1, last);
+		sqlite3_bind_int64(sel, 2, batch);
+		n = 0;
+		while (sqlite3_step(sel) == SQLITE_ROW) {
+			const char *pw = (const char *)sqlite3_column_text(sel, 1);
+
+			scanned++;
+			last = sqlite3_column_int64(sel, 0);
+			if (!pw || pw[0] == '$') {
+				skipped++;
+				continue;
+			}
+			items[n].rowid = last;
+			if (!(items[n].pass = strdup(pw))) {
+				fprintf(stderr, "out of memory\n");
+				return 1;
+			}
+			n++;
+		}
+		sqlite3_reset(sel);
+		if (!scanned)
+			break;
+
+		failed += pool_run(pool, items, n);
+
+		db_exec(db, "BEGIN IMMEDIATE");
+		for (i = 0; i < n; i++) {
+			if (!items[i].hash)
+				continue;
+			sqlite3_bind_text(upd, 1, items[i].hash, -1, SQLITE_STATIC);
+			sqlite3_bind_int64(upd, 2, items[i].rowid);
+			if (sqlite3_step(upd) != SQLITE_DONE)
+				db_fatal(db, "update failed");
+			sqlite3_reset(upd);
+		}
+		state_save(save, job, last);
+		db_exec(db, "COMMIT");
+
+		free_items(items, n);
+		rows += scanned;
+		progress(job, rows, started, 0);
+	}
+
+	state_clear(db, job);
+	progress(job, rows, started, 1);
+	if (skipped && !quiet)
+		fprintf(stderr, "%lu rows were empty or already hashed and were skipped\n"
+			"(hashed rows can only move to a new scheme when the password is next set)\n", skipped);
+	if (failed)
+		fprintf(stderr, "%lu passwords could not be hashed and were skipped\n", failed);
+
+	sqlite3_finalize(sel);
+	sqlite3_finalize(upd);
+	sqlite3_finalize(save);
+	free(items);
+	return failed ? 1 : 0;
+}
+
+/* log every insert, update and delete on table under the user in column */
+static void
+changelog_triggers(sqlite3 *db, const char *log, const char *table,
+	const char *column)
+{
+	db_execf(db, "CREATE TRIGGER IF NOT EXISTS \"%w_%w_ins\" AFTER INSERT ON \"%w\" "
+		"BEGIN INSERT INTO \"%w\"(user) VALUES (new.\"%w\"); END",
+		log, table, table, log, column);
+	db_execf(db, "CREATE TRIGGER IF NOT EXISTS \"%w_%w_upd\" AFTER UPDATE ON \"%w\" "
+		"BEGIN INSERT INTO \"%w\"(user) VALUES (old.\"%w\"); "
+		"INSERT INTO \"%w\"(user) SELECT new.\"%w\" WHERE new.\"%w\" IS NOT old.\"%w\"; END",
+		log, table, table, log, column, log, column, column, column);
+	db_execf(db, "CREATE TRIGGER IF NOT EXISTS \"%w_%w_del\" AFTER DELETE ON \"%w\" "
+		"BEGIN INSERT INTO \"%w\"(user) VALUES (old.\"%w\"); END",
+		log, table, table, log, column);
+}
+
+/*
+ * Install the change log the module polls to invalidate cached results of
+ * users changed by other programs.  AUTOINCREMENT keeps ids from being
+ * reused once old rows are pruned.
+ */
+static int
+cmd_changelog(sqlite3 *db, struct module_options *options, char **specs,
+	int nspecs)
+{
+	const char *log = options->changelog_table;
+	char *table, *column;
+	int i;
+
+	if (!log) {
+		fprintf(stderr, "the changelog_table option is required\n");
+		return 1;
+	}
+	db_exec(db, "BEGIN");
+	db_execf(db, "CREATE TABLE IF NOT EXISTS \"%w\" (id INTEGER PRIMARY KEY "
+		"AUTOINCREMENT, user TEXT NOT NULL, changed INTEGER NOT NULL "
+		"DEFAULT (strftime('%%s', 'now')))", log);
+	changelog_triggers(db, log, options->table, options->user_column);
+	for (i = 0; i < nspecs; i++) {
+		table = specs[i];
+		if (!(column = strchr(table, ':')) || column == table || !column[1]) {
+			fprintf(stderr, "%s: expected TABLE:COLUMN\n", specs[i]);
+			db_exec(db, "ROLLBACK");
+			return 1;
+		}
+		*column++ = '\0';
+		changelog_triggers(db, log, table, column);
+	}
+	db_exec(db, "COMMIT");
+	return 0;
+}
+
+/* where "maintain" is with one of its chores */
+struct chore_state {
+	double last;		/* when the last round finished, or a slice failed */
+	int running;		/* a round is under way */
+	int step;			/* how far it got */
+	int warned;
+};
+
+/*
+ * One kind of upkeep for "maintain".  run() does a slice of it and returns
+ * 1 while the round has more to do, 0 once it is finished, and -1 if the
+ * database was busy or the slice failed; the slice is then tried again
+ * CHORE_RETRY seconds later.
+ */
+struct chore {
+	int every;			/* seconds from the end of one round to the next */
+	int (*run)(sqlite3 *db, struct module_options *options,
+		struct chore_state *c);
+};
+
+static volatile sig_atomic_t stopping;
+
+static void
+stop(int sig)
+{
+	stopping = 1;
+}
+
+/* a statement of a chore; only errors other than contention are reported */
+static int
+chore_exec(sqlite3 *db, const char *sql, int (*row)(void *, int, char **, char **),
+	void *arg)
+{
+	int res = sqlite3_exec(db, sql, row, arg, NULL);
+
+	if (res == SQLITE_BUSY || res == SQLITE_LOCKED)
+		return -1;
+	if (res != SQLITE_OK) {
+		fprintf(stderr, "%s: %s\n", sql, sqlite3_errmsg(db));
+		return -1;
+	}
+	return 0;
+}
+
+/* first column of the first row as a number */
+static int
+chore_value(void *arg, int ncols, char **values, char **names)
+{
+	*(long *)arg = ncols > 0 && values[0] ? atol(values[0]) : -1;
+	return 0;
+}
+
+/* copy what readers no longer need from the WAL into the database */
+static int
+chore_checkpoint(sqlite3 *db, struct module_options *options, struct chore_state *c)
+{
+	int log = 0, done = 0;
+
+	if (sqlite3_wal_checkpoint_v2(db, NULL, SQLITE_CHECKPOINT_PASSIVE, &log,
+			&done) != SQLITE_OK)
+		return sqlite3_errcode(db) == SQLITE_BUSY ? -1 : 0;
+	if (done > 0 && !quiet)
+		fprintf(stderr, "checkpoint: %d of %d frames\n", done, log);
+	return 0;
+}
+
+/* give a few free pages back to the file system */
+static int
+chore_vacuum(sqlite3 *db, struct module_options *options, struct chore_state *c)
+{
+	long mode = -1, free_pages = -1;
+	char sql[64];
+
+	if (chore_exec(db, "PRAGMA auto_vacuum", chore_value, &mode) != 0)
+		return -1;
+	if (mode != 2) {
+		if (!c->warned++ && !quiet)
+			fprintf(stderr, "vacuum: auto_vacuum is not incremental, skipped "
+				"(set PRAGMA auto_vacuum=INCREMENTAL and VACUUM once)\n");
+		return 0;
+	}
+	if (chore_exec(db, "PRAGMA freelist_count", chore_value, &free_pages) != 0)
+		return -1;
+	if (free_pages <= 0)
+		return 0;
+	snprintf(sql, sizeof(sql), "PRAGMA incremental_vacuum(%d)", VACUUM_SLICE);
+	if (chore_exec(db, sql, NULL, NULL) != 0)
+		return -1;
+	if (!quiet)
+		fprintf(stderr, "vacuum: %ld free pages left\n",
+			free_pages > VACUUM_SLICE ? free_pages - VACUUM_SLICE : 0);
+	return free_pages > VACUUM_SLICE;
+}
+
+/* let SQLite refresh whatever statistics it finds stale */
+static int
+chore_optimize(sqlite3 *db, struct module_options *options, struct chore_state *c)
+{
+	if (chore_exec(db, "PRAGMA optimize", NULL, NULL) != 0)
+		return -1;
+	if (!quiet)
+		fprintf(stderr, "optimize: done\n");
+	return 0;
+}
+
+/* ANALYZE one table per slice */
+static int
+chore_analyze(sqlite3 *db, struct module_options *options, struct chore_state *c)
+{
+	sqlite3_stmt *vm;
+	char *sql = NULL;
+	int res;
+
+	vm = db_prepare(db, "SELECT name FROM sqlite_master WHERE type='table' "
+		"AND name NOT LIKE 'sqlite_%%' ORDER BY name LIMIT 1 OFFSET %d", c->step);
+	if ((res = sqlite3_step(vm)) == SQLITE_ROW)
+		sql = sqlite3_mprintf("ANALYZE \"%w\"", sqlite3_column_text(vm, 0));
+	if (res == SQLITE_DONE) {
+		sqlite3_finalize(vm);
+		c->step = 0;
+		return 0;
+	}
+	res = sql ? chore_exec(db, sql, NULL, NULL) : -1;
+	if (res == 0 && !quiet)
+		fprintf(stderr, "analyze: %s\n", sqlite3_column_text(vm, 0));
+	sqlite3_finalize(vm);
+	sqlite3_free(sql);
+	if (res != 0)
+		return -1;
+	c->step++;
+	return 1;
+}
+
+/* forget changelog rows every poller has long since applied */
+static int
+chore_changelog(sqlite3 *db, struct module_options *options, struct chore_state *c)
+{
+	char *sql;
+	int res;
+
+	if (!options->changelog_table)
+		return 0;
+	if (!(sql = sqlite3_mprintf("DELETE FROM \"%w\" WHERE id IN (SELECT id FROM "
+			"\"%w\" WHERE changed < strftime('%%s', 'now') - %d ORDER BY id "
+			"LIMIT %d)", options->changelog_table, options->changelog_table,
+			CHANGELOG_KEEP, CHANGELOG_SLICE)))
+		return -1;
+	res = chore_exec(db, sql, NULL, NULL);
+	sqlite3_free(sql);
+	if (res != 0)
+		return -1;
+	if (sqlite3_changes(db) > 0 && !quiet)
+		fprintf(stderr, "changelog: pruned %d rows\n", sqlite3_changes(db));
+	return sqlite3_changes(db) == CHANGELOG_SLICE;
+}
+
+/* connections the module took host-wide, or 0 if no process has it loaded */
+static uint64_t
+maintain_uses(struct module_options *options, struct p3auth_gen_shared **sh)
+{
+	if (!*sh)
+		*sh = p3auth_shm_attach(options->generation_shm ? options->generation_shm :
+			GEN_SHM_DEFAULT, sizeof(**sh));
+	return *sh ? __atomic_load_n(&(*sh)->uses, __ATOMIC_RELAXED) : 0;
+}
+
+/*
+ * Keep the database in shape without a maintenance window: whenever the
+ * module used the database fewer than idle_rate times a second over the
+ * last tick, do one small slice of whichever chore is due.  While logins
+ * keep it busier, wait twice as long each time before looking again.
+ */
+static int
+cmd_maintain(sqlite3 *db, struct module_options *options, int idle_rate)
+{
+	static const struct chore chores[] = {
+		{ CHECKPOINT_EVERY, chore_checkpoint },
+		{ CHANGELOG_EVERY, chore_changelog },
+		{ VACUUM_EVERY, chore_vacuum },
+		{ OPTIMIZE_EVERY, chore_optimize },
+		{ ANALYZE_EVERY, chore_analyze },
+	};
+	enum { NCHORES = sizeof(chores) / sizeof(chores[0]) };
+	struct chore_state state[NCHORES];
+	struct p3auth_gen_shared *sh = NULL;
+	struct timespec ts;
+	uint64_t uses, prev;
+	double t;
+	int wait = MAINTAIN_TICK_MS, busy = 0, i, res;
+
+	memset(state, 0, sizeof(state));
+	signal(SIGINT, stop);
+	signal(SIGTERM, stop);
+	/* never hold up a login for long, and bound what ANALYZE reads */
+	sqlite3_busy_timeout(db, MAINTAIN_BUSY_MS);
+	db_exec(db, "PRAGMA analysis_limit=1000");
+
+	prev = maintain_uses(options, &sh);
+	while (!stopping) {
+		ts.tv_sec = wait / 1000;
+		ts.tv_nsec = (wait % 1000) * 1000000L;
+		nanosleep(&ts, NULL);
+		if (stopping)
+			break;
+
+		uses = maintain_uses(options, &sh);
+		if ((uses - prev) * 1000 > (uint64_t)idle_rate * wait) {
+			prev = uses;
+			if (!busy++ && !quiet)
+				fprintf(stderr, "busy, backing off\n");
+			wait = wait * 2 > MAINTAIN_BACKOFF_MS ? MAINTAIN_BACKOFF_MS : wait * 2;
+			continue;
+		}
+		prev = uses;
+		busy = 0;
+		wait = MAINTAIN_TICK_MS;
+
+		/* one slice per quiet tick: a round under way first, then the most overdue */
+		t = now();
+		for (i = 0; i < NCHORES && !state[i].running; i++)
+			;
+		if (i == NCHORES)
+			for (i = 0; i < NCHORES; i++)
+				if (!state[i].last || t - state[i].last >= chores[i].every)
+					break;
+		if (i == NCHORES)
+			continue;
+		res = chores[i].run(db, options, &state[i]);
+		state[i].running = res > 0;
+		if (res == 0)
+			state[i].last = t;
+		else if (res < 0)	/* due again in CHORE_RETRY, the others go first */
+			state[i].last = t - chores[i].every + CHORE_RETRY;
+	}
+	p3auth_shm_unmap(sh, sizeof(*sh));
+	return 0;
+}
+
+static int
+cmd_stats(struct module_options *options)
+{
+	const char *name = options->admission_shm ? options->admission_shm : ADMIT_SHM_DEFAULT;
+	struct p3auth_admit_shared *sh;
+
+	if (!(sh = p3auth_shm_attach(name, sizeof(*sh)))) {
+		fprintf(stderr, "%s: no admission control segment\n", name);
+		return 1;
+	}
+	printf("limit %u\n", __atomic_load_n(&sh->limit, __ATOMIC_RELAXED));
+	printf("inflight %u\n", __atomic_load_n(&sh->inflight, __ATOMIC_RELAXED));
+	printf("waiting %u\n", __atomic_load_n(&sh->waiting, __ATOMIC_RELAXED));
+	printf("waiting_priority %u\n", __atomic_load_n(&sh->waiting_priority, __ATOMIC_RELAXED));
+	printf("admitted %llu\n", (unsigned long long)__atomic_load_n(&sh->admitted, __ATOMIC_RELAXED));
+	printf("queued %llu\n", (unsigned long long)__atomic_load_n(&sh->queued, __ATOMIC_RELAXED));
+	printf("shed %llu\n", (unsigned long long)__atomic_load_n(&sh->shed, __ATOMIC_RELAXED));
+	p3auth_shm_unmap(sh, sizeof(*sh));
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct module_options *options;
+	const char *config = NULL;
+	struct pool *pool;
+	sqlite3 *db;
+	size_t batch = DEFAULT_BATCH;
+	int nthreads = 0, restart = 0, idle_rate = MAINTAIN_IDLE_RATE, rc, c;
+	char **extra = NULL;
+	int nextra = 0;
+
+	if (!(options = calloc(1, sizeof(*options))) ||
+		!(extra = calloc(argc, sizeof(*extra)))) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	options->pw_type = PW_CLEAR;
+
+	while ((c = getopt(argc, argv, "c:s:o:j:b:i:rq")) != -1) {
+		switch (c) {
+		case 'c':
+			config = optarg;
+			break;
+		case 's':
+			free(options->service);
+			options->service = strdup(optarg);
+			break;
+		case 'o':
+			extra[nextra++] = optarg;
+			break;
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		case 'b':
+			batch = strtoul(optarg, NULL, 10);
+			break;
+		case 'i':
+			idle_rate = atoi(optarg);
+			break;
+		case 'r':
+			restart = 1;
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind >= argc || batch == 0)
+		usage();
+
+	/* same precedence as the module: config file, then explicit options */
+	if (config) {
+		FILE *fp = fopen(config, "r");
+
+		if (!fp) {
+			perror(config);
+			return 1;
+		}
+		fclose(fp);
+		get_module_options_from_file(config, options, 1);
+	} else {
+		get_module_options_from_file(CONF, options, 0);
+	}
+	for (c = 0; c < nextra; c++)
+		set_module_option(extra[c], options);
+
+	if (!strcmp(argv[optind], "stats"))
+		return cmd_stats(options);
+
+	if (options_valid(options) != 0 || !options->pwd_column) {
+		fprintf(stderr, "the database, table, user_column and pwd_column options are required\n");
+		return 1;
+	}
+
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads <= 0)
+		nthreads = 1;
+
+	if (sqlite3_open_v2(options->database, &db, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK)
+		db_fatal(db, options->database);
+	sqlite3_busy_timeout(db, BUSY_TIMEOUT);
+
+	pool = pool_create(options, nthreads);
+
+	if (!strcmp(argv[optind], "import") && optind + 1 < argc)
+		rc = cmd_import(db, options, pool, batch, argv[optind + 1], restart);
+	else if (!strcmp(argv[optind], "verify") && optind + 1 < argc)
+		rc = cmd_verify(db, options, batch, argv[optind + 1]);
+	else if (!strcmp(argv[optind], "rehash"))
+		rc = cmd_rehash(db, options, pool, batch, restart);
+	else if (!strcmp(argv[optind], "changelog"))
+		rc = cmd_changelog(db, options, argv + optind + 1, argc - optind - 1);
+	else if (!strcmp(argv[optind], "maintain"))
+		rc = cmd_maintain(db, options, idle_rate);
+	else
+		usage();
+
+	pool_destroy(pool);
+	sqlite3_close(db);
+	free_module_options(options);
+	free(extra);
+	return rc;
+}
@@ -0,0 +1,521 @@
+/*
+ * pam_sqlite3-bench: microbenchmarks of the module's building blocks
+ *
+ * Times query formatting, option parsing, salt generation and hashing on
+ * their own, and the whole verify path against a scratch database on
+ * tmpfs, reporting nanoseconds and heap allocations per operation.
+ * Results can be saved with -o and compared against a saved run with -b,
+ * e.g. between two builds:
+ *
+ *     $ make bench && ./pam_sqlite3-bench -o before
+ *     ... rebuild ...
+ *     $ ./pam_sqlite3-bench -b before
+ *
+ * This file is part of pam_sqlite3, see pam_sqlite3.c for copyright and
+ * licensing information.
+ */
+
+#include "pam_sqlite3_int.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#define DEFAULT_MIN_TIME	200		/* ms per benchmark */
+#define MAX_RESULTS			64
+#define CONFIG_SECTIONS		100
+#define CONFIG_LINES		10		/* per section */
+#define BENCH_USERS			1000
+
+struct bench {
+	const char *name;
+	void (*run)(void *arg);
+	void *arg;
+};
+
+struct result {
+	char name[64];
+	double ns;
+	double allocs;			/* < 0 when not counted */
+};
+
+static struct result results[MAX_RESULTS];
+static int nresults;
+static char scratch_dir[256];
+
+/*
+ * Count heap allocations by interposing on glibc's malloc; everything in
+ * the process, SQLite and libc included, goes through these.
+ */
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+
+static unsigned long nallocs;
+
+void *
+malloc(size_t size)
+{
+	__atomic_add_fetch(&nallocs, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t n, size_t size)
+{
+	__atomic_add_fetch(&nallocs, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(n, size);
+}
+
+void *
+realloc(void *p, size_t size)
+{
+	__atomic_add_fetch(&nallocs, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(p, size);
+}
+#define ALLOCS()	__atomic_load_n(&nallocs, __ATOMIC_RELAXED)
+#define COUNTS_ALLOCS	1
+#else
+#define ALLOCS()	0UL
+#define COUNTS_ALLOCS	0
+#endif
+
+static double
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void
+fatal(const char *what)
+{
+	fprintf(stderr, "%s\n", what);
+	exit(1);
+}
+
+/* free_module_options() frees the structure as well */
+static struct module_options *
+new_options(void)
+{
+	struct module_options *options = calloc(1, sizeof(*options));
+
+	if (!options)
+		fatal("out of memory");
+	return options;
+}
+
+/* run one benchmark for about min_ms and record its cost per call */
+static void
+measure(const struct bench *b, int min_ms)
+{
+	struct result *r;
+	unsigned long n = 1, i, allocs;
+	double start, elapsed;
+
+	b->run(b->arg);		/* warm up caches and connections */
+	for (;;) {
+		allocs = ALLOCS();
+		start = now_ns();
+		for (i = 0; i < n; i++)
+			b->run(b->arg);
+		elapsed = now_ns() - start;
+		allocs = ALLOCS() - allocs;
+		if (elapsed >= min_ms * 1e6)
+			break;
+		/* aim a little past the target from what this round took */
+		if (elapsed < min_ms * 1e5)
+			n *= 10;
+		else
+			n = n * (min_ms * 1.2e6 / elapsed) + 1;
+	}
+
+	if (nresults == MAX_RESULTS)
+		fatal("too many benchmarks");
+	r = &results[nresults++];
+	snprintf(r->name, sizeof(r->name), "%s", b->name);
+	r->ns = elapsed / n;
+	r->allocs = COUNTS_ALLOCS ? (double)allocs / n : -1;
+}
+
+/* format_query */
+
+struct format_arg {
+	struct module_options *options;
+	const char *template;
+	const char *user;
+	const char *pass;
+};
+
+static void
+run_format(void *arg)
+{
+	struct format_arg *a = arg;
+	char *q = format_query(a->template, a->options, a->user, a->pass, NULL);
+
+	secret_free(q);
+}
+
+/* set_module_option / get_module_options_from_file */
+
+static const char *const bench_options[] = {
+	"database=/etc/sysdb", "table=account", "user_column=user_name",
+	"pwd_column=user_password", "expired_column=acc_expired",
+	"newtok_column=acc_new_pwreq", "pw_type=sha-512",
+	"sql_verify=SELECT %Op FROM %Ot WHERE %Ou='%U'",
+	"allowed_groups=wheel, staff, operators", "group_cache_ttl=60",
+	NULL
+};
+
+static void
+run_set_options(void *arg)
+{
+	struct module_options *options = new_options();
+	int i;
+
+	for (i = 0; bench_options[i]; i++)
+		set_module_option(bench_options[i], options);
+	free_module_options(options);
+}
+
+struct config_arg {
+	char path[300];
+	const char *service;
+};
+
+static void
+run_read_config(void *arg)
+{
+	struct config_arg *a = arg;
+	struct module_options *options = new_options();
+
+	if (a->service)
+		options->service = strdup(a->service);
+	get_module_options_from_file(a->path, options, 0);
+	free_module_options(options);
+}
+
+/* a config of CONFIG_SECTIONS service sections, all set explicitly */
+static void
+write_config(const char *path)
+{
+	FILE *fp;
+	int s, i;
+
+	if (!(fp = fopen(path, "w")))
+		fatal(path);
+	fprintf(fp, "# generated by pam_sqlite3-bench\n");
+	for (i = 0; bench_options[i]; i++)
+		fprintf(fp, "%s\n", bench_options[i]);
+	for (s = 0; s < CONFIG_SECTIONS; s++) {
+		fprintf(fp, "\n[service%d]\n", s);
+		for (i = 0; i < CONFIG_LINES && bench_options[i]; i++)
+			fprintf(fp, "%s\n", bench_options[i]);
+	}
+	fclose(fp);
+}
+
+/* crypt_make_salt / encrypt_password */
+
+static void
+run_salt(void *arg)
+{
+	char salt[PW_SALT_LEN];
+
+	crypt_make_salt(arg, salt);
+}
+
+static void
+run_encrypt(void *arg)
+{
+	char *s = encrypt_password(arg, "correct horse battery staple");
+
+	secret_free(s);
+}
+
+/* p3auth_verify_password */
+
+struct verify_arg {
+	p3auth_ctx *ctx;
+	const char *user;
+	const char *pass;
+	unsigned next;
+};
+
+static void
+run_verify(void *arg)
+{
+	struct verify_arg *a = arg;
+	char user[32];
+
+	if (a->user) {
+		p3auth_verify_password(a->ctx, a->user, a->pass);
+		return;
+	}
+	/* walk the table so the lookups are not all the same row */
+	snprintf(user, sizeof(user), "user%u", a->next++ % BENCH_USERS);
+	p3auth_verify_password(a->ctx, user, a->pass);
+}
+
+/* a table of BENCH_USERS users, all with password pass hashed as pw_type */
+static void
+write_database(const char *path, const char *pw_type, const char *pass)
+{
+	struct module_options *options = new_options();
+	sqlite3 *db;
+	sqlite3_stmt *vm;
+	char opt[64], user[32], *hash;
+	int i;
+
+	snprintf(opt, sizeof(opt), "pw_type=%s", pw_type);
+	set_module_option(opt, options);
+
+	unlink(path);
+	if (sqlite3_open(path, &db) != SQLITE_OK ||
+			sqlite3_exec(db, "CREATE TABLE account (user_name TEXT PRIMARY KEY, "
+				"user_password TEXT, acc_expired TEXT, acc_new_pwreq TEXT); BEGIN",
+				NULL, NULL, NULL) != SQLITE_OK ||
+			sqlite3_prepare_v2(db, "INSERT INTO account VALUES (?, ?, '0', '0')",
+				-1, &vm, NULL) != SQLITE_OK)
+		fatal(sqlite3_errmsg(db));
+	/* one hash will do: verifying costs the same whatever the salt */
+	if (!(hash = encrypt_password(options, pass)))
+		fatal("cannot hash");
+	for (i = 0; i < BENCH_USERS; i++) {
+		snprintf(user, sizeof(user), "user%d", i);
+		sqlite3_bind_text(vm, 1, user, -1, SQLITE_TRANSIENT);
+		sqlite3_bind_text(vm, 2, hash, -1, SQLITE_STATIC);
+		sqlite3_step(vm);
+		sqlite3_reset(vm);
+	}
+	sqlite3_finalize(vm);
+	sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+	sqlite3_close(db);
+	secret_free(hash);
+	free_module_options(options);
+}
+
+static p3auth_ctx *
+verify_context(const char *path, const char *pw_type)
+{
+	char opt[320];
+	p3auth_ctx *ctx;
+
+	if (!(ctx = p3auth_new()))
+		fatal("out of memory");
+	snprintf(opt, sizeof(opt), "database=%s", path);
+	p3auth_set_option(ctx, opt);
+	p3auth_set_option(ctx, "table=account");
+	p3auth_set_option(ctx, "user_column=user_name");
+	p3auth_set_option(ctx, "pwd_column=user_password");
+	snprintf(opt, sizeof(opt), "pw_type=%s", pw_type);
+	p3auth_set_option(ctx, opt);
+	if (p3auth_prepare(ctx) != 0)
+		fatal("cannot prepare the verify context");
+	return ctx;
+}
+
+/* results */
+
+static void
+save_results(const char *path)
+{
+	FILE *fp;
+	int i;
+
+	if (!(fp = fopen(path, "w")))
+		fatal(path);
+	for (i = 0; i < nresults; i++)
+		fprintf(fp, "%s %.1f %.2f\n", results[i].name, results[i].ns, results[i].allocs);
+	fclose(fp);
+}
+
+static const struct result *
+find_baseline(struct result *base, int nbase, const char *name)
+{
+	int i;
+
+	for (i = 0; i < nbase; i++)
+		if (!strcmp(base[i].name, name))
+			return &base[i];
+	return NULL;
+}
+
+static void
+print_results(const char *baseline)
+{
+	struct result base[MAX_RESULTS];
+	const struct result *b;
+	char line[128];
+	int nbase = 0, i;
+	FILE *fp;
+
+	if (baseline) {
+		if (!(fp = fopen(baseline, "r")))
+			fatal(baseline);
+		while (nbase < MAX_RESULTS && fgets(line, sizeof(line), fp))
+			if (sscanf(line, "%63s %lf %lf", base[nbase].name, &base[nbase].ns,
+					&base[nbase].allocs) == 3)
+				nbase++;
+		fclose(fp);
+	}
+
+	printf("%-32s %12s %10s%s\n", "benchmark", "ns/op", "allocs/op",
+		baseline ? "     change" : "");
+	for (i = 0; i < nresults; i++) {
+		printf("%-32s %12.1f ", results[i].name, results[i].ns);
+		if (results[i].allocs < 0)
+			printf("%10s", "-");
+		else
+			printf("%10.2f", results[i].allocs);
+		if ((b = find_baseline(base, nbase, results[i].name)) && b->ns > 0)
+			printf("  %+8.1f%%", (results[i].ns - b->ns) * 100 / b->ns);
+		printf("\n");
+	}
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"usage: pam_sqlite3-bench [-t ms] [-o results] [-b baseline] [filter]\n"
+		"\n"
+		"    -t ms         run each benchmark for at least ms (default %d)\n"
+		"    -o results    save the results for a later -b\n"
+		"    -b baseline   show the change from saved results\n"
+		"    filter        only run benchmarks whose name contains it\n",
+		DEFAULT_MIN_TIME);
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	static const char *const schemes[] = {
+		"clear",
+#if HAVE_MD5_CRYPT
+		"md5",
+#endif
+#if HAVE_SHA256_CRYPT
+		"sha-256",
+#endif
+#if HAVE_SHA512_CRYPT
+		"sha-512",
+#endif
+		"crypt",
+	};
+#define NSCHEMES	(sizeof(schemes) / sizeof(schemes[0]))
+	struct module_options *query_options, *scheme_options[NSCHEMES];
+	struct format_arg plain, escaped;
+	struct config_arg config_global, config_service;
+	struct verify_arg verify_clear, verify_hashed, verify_unknown;
+	char db_clear[300], db_hashed[300], opt[64];
+	struct bench benches[MAX_RESULTS];
+	const char *save = NULL, *baseline = NULL, *filter = NULL, *hashed;
+	int min_ms = DEFAULT_MIN_TIME, n = 0, i, c;
+	size_t s;
+
+	while ((c = getopt(argc, argv, "t:o:b:")) != -1) {
+		switch (c) {
+		case 't':
+			min_ms = atoi(optarg);
+			break;
+		case 'o':
+			save = optarg;
+			break;
+		case 'b':
+			baseline = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind < argc)
+		filter = argv[optind++];
+	if (optind < argc || min_ms <= 0)
+		usage();
+
+	/* scratch files go on tmpfs where there is one */
+	snprintf(scratch_dir, sizeof(scratch_dir), "%s/pam_sqlite3-bench.%d",
+		access("/dev/shm", W_OK) == 0 ? "/dev/shm" : "/tmp", (int)getpid());
+	if (mkdir(scratch_dir, 0700) != 0)
+		fatal(scratch_dir);
+
+	query_options = new_options();
+	for (i = 0; bench_options[i]; i++)
+		set_module_option(bench_options[i], query_options);
+	plain.options = escaped.options = query_options;
+	plain.template = "SELECT %Op FROM %Ot WHERE %Ou='%U'";
+	plain.user = "alice";
+	plain.pass = NULL;
+	escaped.template = "SELECT 1 FROM %Ot WHERE %Ou='%U' AND %Op='%P' "
+		"AND (%Ox='y' OR %Ox='1') AND '%U' <> '%P' -- 100%% %U";
+	escaped.user = "o'neil'''-'s''' \"quoted\" user'";
+	escaped.pass = "pa''ss'wo''rd'''with'''''quotes'";
+	benches[n++] = (struct bench){ "format_query/plain", run_format, &plain };
+	benches[n++] = (struct bench){ "format_query/escaped", run_format, &escaped };
+
+	benches[n++] = (struct bench){ "set_module_option/10", run_set_options, NULL };
+	snprintf(config_global.path, sizeof(config_global.path), "%s/bench.conf", scratch_dir);
+	write_config(config_global.path);
+	config_global.service = NULL;
+	config_service = config_global;
+	config_service.service = "service99";
+	benches[n++] = (struct bench){ "read_config/global", run_read_config, &config_global };
+	benches[n++] = (struct bench){ "read_config/section", run_read_config, &config_service };
+
+	for (s = 0; s < NSCHEMES; s++) {
+		static char names[NSCHEMES][2][48];
+
+		scheme_options[s] = new_options();
+		snprintf(opt, sizeof(opt), "pw_type=%s", schemes[s]);
+		set_module_option(opt, scheme_options[s]);
+		snprintf(names[s][0], sizeof(names[s][0]), "crypt_make_salt/%s", schemes[s]);
+		snprintf(names[s][1], sizeof(names[s][1]), "encrypt_password/%s", schemes[s]);
+		if (strcmp(schemes[s], "clear"))
+			benches[n++] = (struct bench){ names[s][0], run_salt, scheme_options[s] };
+		benches[n++] = (struct bench){ names[s][1], run_encrypt, scheme_options[s] };
+	}
+
+	/* the strongest scheme available stands in for a real deployment */
+	hashed = schemes[NSCHEMES - 1];
+	for (s = 0; s < NSCHEMES; s++)
+		if (!strncmp(schemes[s], "sha-", 4))
+			hashed = schemes[s];
+	snprintf(db_clear, sizeof(db_clear), "%s/clear.db", scratch_dir);
+	snprintf(db_hashed, sizeof(db_hashed), "%s/hashed.db", scratch_dir);
+	write_database(db_clear, "clear", "secret");
+	write_database(db_hashed, hashed, "secret");
+	verify_clear = (struct verify_arg){ verify_context(db_clear, "clear"), NULL, "secret", 0 };
+	verify_hashed = (struct verify_arg){ verify_context(db_hashed, hashed), NULL, "secret", 0 };
+	verify_unknown = (struct verify_arg){ verify_clear.ctx, "nobody", "secret", 0 };
+	benches[n++] = (struct bench){ "verify/clear", run_verify, &verify_clear };
+	benches[n++] = (struct bench){ "verify/hashed", run_verify, &verify_hashed };
+	benches[n++] = (struct bench){ "verify/unknown_user", run_verify, &verify_unknown };
+
+	for (i = 0; i < n; i++)
+		if (!filter || strstr(benches[i].name, filter))
+			measure(&benches[i], min_ms);
+
+	print_results(baseline);
+	if (save)
+		save_results(save);
+
+	p3auth_free(verify_clear.ctx);
+	p3auth_free(verify_hashed.ctx);
+	free_module_options(query_options);
+	for (s = 0; s < NSCHEMES; s++)
+		free_module_options(scheme_options[s]);
+	unlink(config_global.path);
+	unlink(db_clear);
+	unlink(db_hashed);
+	rmdir(scratch_dir);
+	return 0;
+}
@@ -0,0 +1,241 @@
+/*
+ * Password hashing for pam_sqlite3, shared by the PAM module and the
+ * pam_sqlite3-admin tool.  Everything in here is safe to call from
+ * several threads at once.
+ *
+ * This file is part of pam_sqlite3, see pam_sqlite3.c for copyright and
+ * licensing information.
+ */
+
+#include "pam_sqlite3_int.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#if HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#define SALT_CHARS	16
+
+/* memset() that the compiler may not optimise away */
+void memzero_explicit(void *s, size_t cnt)
+{
+    memset(s, 0, cnt);
+    __asm__ __volatile__("": :"r"(s): "memory");
+}
+
+/* fill buf with random bytes, preferring the kernel's generator */
+static void
+random_bytes(unsigned char *buf, size_t len)
+{
+	static unsigned long x;
+	unsigned int seed;
+	ssize_t got = 0;
+	size_t i;
+	int fd;
+
+	if ((fd = open("/dev/urandom", O_RDONLY)) >= 0) {
+		got = read(fd, buf, len);
+		close(fd);
+	}
+	if (got == (ssize_t)len)
+		return;
+
+	/* no urandom (chroot?), fall back to the old time based mix */
+	x += time(NULL) + getpid() + clock();
+	seed = (unsigned int)(x ^ (unsigned long)buf);
+	for (i = 0; i < len; i++)
+		buf[i] = rand_r(&seed) >> 7;
+}
+
+/* generate a random salt for the preferred scheme into salt[PW_SALT_LEN] */
+char *
+crypt_make_salt(struct module_options *options, char *salt)
+{
+	static const char salt_chars[64] =
+		"abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789./";
+	unsigned char rnd[SALT_CHARS];
+	char *p = salt;
+	int i;
+
+	switch(options->pw_type) {
+#if HAVE_MD5_CRYPT
+	case PW_MD5:
+		p += sprintf(p, "$1$");
+		break;
+#endif
+#if HAVE_SHA256_CRYPT
+	case PW_SHA256:
+		p += sprintf(p, "$5$");
+		break;
+#endif
+#if HAVE_SHA512_CRYPT
+	case PW_SHA512:
+		p += sprintf(p, "$6$");
+		break;
+#endif
+	case PW_CRYPT:
+		break;
+	default:
+		salt[0] = '\0';
+		return salt;
+	}
+
+	random_bytes(rnd, sizeof(rnd));
+	for (i = 0; i < (options->pw_type == PW_CRYPT ? 2 : SALT_CHARS); i++)
+		*p++ = salt_chars[rnd[i] & 63];
+	if (options->pw_type != PW_CRYPT)
+		*p++ = '$';
+	*p = '\0';
+
+	memzero_explicit(rnd, sizeof(rnd));
+	return salt;
+}
+
+/*
+ * crypt() the password into the caller supplied scratch area.  Uses
+ * crypt_r() where available, otherwise serialises calls to crypt().
+ */
+const char *
+pam_sqlite3_crypt(const char *pass, const char *salt, struct crypt_data *data)
+{
+#if !HAVE_CRYPT_R
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+	const char *res;
+
+	PROBE1(crypt__start, strlen(salt));
+#if HAVE_CRYPT_R
+	data->initialized = 0;
+	res = crypt_r(pass, salt, data);
+#else
+	pthread_mutex_lock(&lock);
+	res = crypt(pass, salt);
+	if (res && strlen(res) < sizeof(data->output)) {
+		strcpy(data->output, res);
+		res = data->output;
+	} else {
+		res = NULL;
+	}
+	pthread_mutex_unlock(&lock);
+#endif
+	PROBE1(crypt__done, res != NULL);
+	return res;
+}
+
+/*
+ * encrypt password using the preferred encryption scheme; the result is
+ * from the secret pool, release it with secret_free()
+ */
+char *
+encrypt_password_r(struct module_options *options, const char *pass,
+	struct crypt_data *data)
+{
+	char salt[PW_SALT_LEN];
+	const char *hash;
+	char *s = NULL;
+
+	switch(options->pw_type) {
+#if HAVE_MD5_CRYPT
+		case PW_MD5:
+#endif
+#if HAVE_SHA256_CRYPT
+		case PW_SHA256:
+#endif
+#if HAVE_SHA512_CRYPT
+		case PW_SHA512:
+#endif
+		case PW_CRYPT:
+			if ((hash = pam_sqlite3_crypt(pass, crypt_make_salt(options, salt), data)))
+				s = secret_strdup(hash);
+			break;
+		case PW_CLEAR:
+		default:
+			s = secret_strdup(pass);
+	}
+	return s;
+}
+
+/* as encrypt_password_r(), with a throwaway scratch area */
+char *
+encrypt_password(struct module_options *options, const char *pass)
+{
+	struct crypt_data *data;
+	char *s;
+
+	if (!(data = secret_alloc(sizeof(*data))))
+		return NULL;
+	s = encrypt_password_r(options, pass, data);
+	secret_free(data);
+	return s;
+}
+
+/* compare two strings in time that depends only on their lengths */
+int
+password_equal(const char *a, const char *b)
+{
+	size_t la = strlen(a), lb = strlen(b), i;
+	unsigned char diff = la != lb;
+
+	for (i = 0; i < la; i++)
+		diff |= (unsigned char)a[i] ^ (unsigned char)b[i % (lb ? lb : 1)];
+	return diff == 0;
+}
+
+/*
+ * Check pass against a stored password of the configured scheme: 1 if it
+ * matches, 0 if not, -1 if crypt() failed.
+ */
+int
+password_matches(struct module_options *options, const char *pass,
+	const char *stored, struct crypt_data *data)
+{
+	const char *hash;
+
+	if (options->pw_type == PW_CLEAR)
+		return password_equal(pass, stored);
+	if (!(hash = pam_sqlite3_crypt(pass, stored, data)))
+		return -1;
+	return password_equal(hash, stored);
+}
+
+/* pam_verify(stored, supplied): 1 if supplied matches stored, else 0 */
+static void
+sql_pam_verify(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+	struct module_options *options = sqlite3_user_data(context);
+	const char *stored = (const char *)sqlite3_value_text(argv[0]);
+	const char *pass = (const char *)sqlite3_value_text(argv[1]);
+	struct crypt_data *data;
+	int match;
+
+	if (!stored || !pass) {
+		sqlite3_result_null(context);
+		return;
+	}
+	if (options->pw_type == PW_CLEAR) {
+		sqlite3_result_int(context, password_equal(pass, stored));
+		return;
+	}
+	if (!(data = secret_alloc(sizeof(*data)))) {
+		sqlite3_result_error_nomem(context);
+		return;
+	}
+	match = password_matches(options, pass, stored, data);
+	secret_free(data);
+	sqlite3_result_int(context, match == 1);
+}
+
+/* make the module's SQL functions available to queries on db */
+int
+register_sql_functions(sqlite3 *db, struct module_options *options)
+{
+	return sqlite3_create_function(db, "pam_verify", 2,
+		SQLITE_UTF8 | SQLITE_DETERMINISTIC, options, sql_pam_verify, NULL, NULL);
+}
@@ -0,0 +1,389 @@
+/*
+ * Internal interfaces shared by pam_sqlite3 and its companion tools.
+ *
+ * This file is part of pam_sqlite3, see pam_sqlite3.c for copyright and
+ * licensing information.
+ */
+
+#ifndef PAM_SQLITE3_INT_H
+#define PAM_SQLITE3_INT_H
+
+#include "config.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <time.h>
+#if HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+#include <sqlite3.h>
+#if HAVE_CRYPT_H
+#include <crypt.h>
+#endif
+#include "p3auth.h"
+
+#define CONF					"/etc/pam_sqlite3.conf"
+
+#define DBGLOG(x...)  if(options->debug) {							\
+						  openlog("PAM_sqlite3", LOG_PID, LOG_AUTH); \
+						  syslog(LOG_DEBUG, ##x);					\
+						  closelog();								\
+					  }
+#define SYSLOG(x...)  do {											\
+						  openlog("PAM_sqlite3", LOG_PID, LOG_AUTH); \
+						  syslog(LOG_INFO, ##x);					\
+						  closelog();								\
+					  } while(0)
+#define SYSLOGERR(x...) SYSLOG("Error: " x)
+
+/*
+ * USDT probes for perf and bpftrace, see pam_sqlite3.bt for the list.
+ * Without <sys/sdt.h> they and their arguments compile to nothing; with
+ * it a disabled probe is a nop, but its arguments are still evaluated, so
+ * keep them cheap.  Never pass a password or anything derived from one.
+ */
+#if HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define PROBE(name)					DTRACE_PROBE(pam_sqlite3, name)
+#define PROBE1(name, a)				DTRACE_PROBE1(pam_sqlite3, name, a)
+#define PROBE2(name, a, b)			DTRACE_PROBE2(pam_sqlite3, name, a, b)
+#define PROBE3(name, a, b, c)		DTRACE_PROBE3(pam_sqlite3, name, a, b, c)
+#define PROBE4(name, a, b, c, d)	DTRACE_PROBE4(pam_sqlite3, name, a, b, c, d)
+#else
+#define PROBE(name)					do { } while (0)
+#define PROBE1(name, a)				do { } while (0)
+#define PROBE2(name, a, b)			do { } while (0)
+#define PROBE3(name, a, b, c)		do { } while (0)
+#define PROBE4(name, a, b, c, d)	do { } while (0)
+#endif
+
+/* a user as probes see it, see p3auth_user_hash() */
+#define PROBE_USER(user)	((user) ? p3auth_user_hash(user) : 0)
+
+typedef enum {
+	PW_CLEAR = 1,
+#if HAVE_MD5_CRYPT
+	PW_MD5,
+#endif
+#if HAVE_SHA256_CRYPT
+	PW_SHA256,
+#endif
+#if HAVE_SHA512_CRYPT
+	PW_SHA512,
+#endif
+	PW_CRYPT,
+} pw_scheme;
+
+/* the libnss_sqlite3 lookups, see nss_sqlite3.c */
+enum {
+	NSS_GETPWNAM,
+	NSS_GETPWUID,
+	NSS_GETPWENT,
+	NSS_GETGRNAM,
+	NSS_GETGRGID,
+	NSS_GETGRENT,
+	NSS_GETGRMEM,
+	NSS_NQUERIES
+};
+
+struct module_options {
+	char *database;
+	char *table;
+	char *user_column;
+	char *pwd_column;
+	char *expired_column;
+	char *newtok_column;
+	pw_scheme pw_type;
+	int debug;
+	int no_prefetch;
+	int verify_in_db;
+	char *sql_verify;
+	char *sql_check_expired;
+	char *sql_check_newtok;
+	char *sql_set_passwd;
+	char *sql_check_group;
+	char *sql_check_host;
+	char *allowed_groups;
+	int group_cache_ttl;
+	int max_hash_concurrency;
+	int hash_queue_timeout;
+	int recent_login_window;
+	int reader_connections;
+	int max_sessions;
+	char *session_table;
+	char *session_shm;
+	char *admission_shm;
+	char *generation_shm;
+	char *changelog_table;
+	int changelog_poll_ms;
+	char *replica;
+	int password_history;
+	char *history_table;
+	int replica_refresh_ms;
+	char *audit_database;
+	char *audit_table;
+	int audit_batch;
+	int audit_flush_ms;
+	char *trace_file;
+	char *sql_nss[NSS_NQUERIES];
+	char *service;		/* selects [service] sections in config files */
+};
+
+/* an SQL template with the %O and %% escapes already expanded */
+struct p3auth_query {
+	char *sql;		/* NULL if the template could not be compiled */
+	int bind;		/* '%U' and '%P' became ?1 and ?2, else expand per call */
+	int passwd;		/* the template uses %P */
+};
+
+/* first member of every shared memory segment, see p3auth_shm.c */
+struct p3auth_shm_header {
+	uint32_t magic;
+	uint32_t size;
+};
+
+#define HISTORY_TABLE_DEFAULT	"password_history"
+
+#define ADMIT_SHM_DEFAULT	"/pam_sqlite3.admit"
+#define ADMIT_MAX_SLOTS		256
+#define ADMIT_RECENT_SLOTS	4096
+#define ADMIT_UNLIMITED		(-2)
+
+struct p3auth_admit_recent {
+	uint64_t user;
+	uint64_t when;
+};
+
+/* the admission control segment shared by every process on the host */
+struct p3auth_admit_shared {
+	struct p3auth_shm_header hdr;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint32_t limit;				/* max_hash_concurrency */
+	uint32_t inflight;			/* slots in use */
+	uint32_t waiting;			/* queue depth */
+	uint32_t waiting_priority;	/* of which recent users */
+	uint64_t admitted;			/* total given a slot */
+	uint64_t queued;			/* of which had to wait */
+	uint64_t shed;				/* total turned away */
+	pid_t holders[ADMIT_MAX_SLOTS];
+	struct p3auth_admit_recent recent[ADMIT_RECENT_SLOTS];
+};
+
+#define GEN_SHM_DEFAULT		"/pam_sqlite3.gen"
+#define GEN_SLOTS			4096
+
+/* per-user cache generations shared by every process on the host */
+struct p3auth_gen_shared {
+	struct p3auth_shm_header hdr;
+	uint64_t polled;			/* CLOCK_MONOTONIC ms of the last changelog poll */
+	uint64_t seen;				/* highest changelog id applied */
+	uint64_t uses;				/* connections taken, a measure of load */
+	uint32_t gen[GEN_SLOTS];	/* by p3auth_user_hash() */
+};
+
+#define SESS_SHM_DEFAULT	"/pam_sqlite3.sess"
+#define SESS_SLOTS			8192
+
+struct p3auth_sess_slot {
+	uint64_t user;				/* p3auth_user_hash(), 0 when free */
+	uint32_t count;				/* open sessions */
+};
+
+/* live session counts shared by every process on the host */
+struct p3auth_sess_shared {
+	struct p3auth_shm_header hdr;
+	pthread_mutex_t lock;
+	struct p3auth_sess_slot slot[SESS_SLOTS];	/* linear probing */
+};
+
+/* an open database with the context's bindable queries prepared on it */
+struct p3auth_conn {
+	struct p3auth_conn *next;
+	sqlite3 *db;
+	dev_t dev;		/* of the database file when it was opened */
+	ino_t ino;
+	pthread_t owner;	/* thread that took it last */
+	sqlite3_stmt *verify;
+	sqlite3_stmt *check_expired;
+	sqlite3_stmt *check_newtok;
+	sqlite3_stmt *check_group;
+	sqlite3_stmt *check_host;
+	sqlite3_stmt *nss[NSS_NQUERIES];
+};
+
+#define CONN_CACHE_MAX		8		/* default reader_connections */
+
+/* a user's cached sql_check_group result, see group_cache_ttl */
+struct p3auth_member {
+	char *user;
+	time_t when;
+	uint32_t gen;		/* gen_current() before the lookup */
+	int member;
+};
+
+#define GROUP_CACHE_SLOTS	256
+
+/* longest user and service names kept in audit records */
+#define AUDIT_USER_MAX		128
+#define AUDIT_SERVICE_MAX	32
+
+struct p3auth_audit;
+struct p3auth_trace;
+struct p3auth_sess_log;
+
+/* first line of a trace_file, followed by " salt=<hex>" */
+#define TRACE_MAGIC			"# pam_sqlite3 trace 1"
+
+struct p3auth_ctx {
+	struct module_options *options;
+	struct p3auth_query verify;
+	struct p3auth_query check_expired;
+	struct p3auth_query check_newtok;
+	struct p3auth_query set_passwd;
+	struct p3auth_query check_group;
+	struct p3auth_query check_host;
+	struct p3auth_query nss[NSS_NQUERIES];	/* compiled by nss_prepare() */
+	struct p3auth_admit_shared *admit;
+	struct p3auth_gen_shared *gen;
+	struct p3auth_sess_shared *sess;	/* NULL unless max_sessions is set */
+	struct p3auth_sess_log *sess_log;	/* NULL unless session_table is set */
+	struct p3auth_audit *audit;		/* NULL unless audit_table is set */
+	struct p3auth_trace *trace;		/* NULL unless trace_file is set */
+
+	char **allowed_groups;		/* sorted for bsearch() */
+	int nallowed;
+	pthread_mutex_t group_lock;
+	struct p3auth_member *members;	/* GROUP_CACHE_SLOTS, if group_cache_ttl */
+
+	pthread_mutex_t conn_lock;
+	struct p3auth_conn *idle;	/* read-only connections not in use */
+	int nidle;
+	pid_t pid;					/* that opened them */
+	pthread_mutex_t writer_lock;	/* held by the user of writer */
+	struct p3auth_conn *writer;	/* the one connection that may write */
+};
+
+/* FNV-1a, for keying per-user shared state without storing user names */
+static inline uint64_t
+p3auth_user_hash(const char *user)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	while (*user) {
+		h ^= (unsigned char)*user++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+#if !HAVE_CRYPT_R
+/* stand-in for the crypt_r() scratch area when only crypt() is available */
+struct crypt_data {
+	char output[384];
+};
+#endif
+
+/* big enough for any salt crypt_make_salt() produces */
+#define PW_SALT_LEN		32
+
+/* option names of the sql_nss templates, in NSS_* order */
+extern const char *const nss_option_names[NSS_NQUERIES];
+
+/* pam_sqlite3_option.c */
+void set_module_option(const char *option, struct module_options *options);
+int get_module_options_from_file(const char *filename,
+	struct module_options *opts, int warn);
+void free_module_options(struct module_options *options);
+int options_valid(struct module_options *options);
+
+/* pam_sqlite3_crypt.c */
+char *crypt_make_salt(struct module_options *options, char *salt);
+const char *pam_sqlite3_crypt(const char *pass, const char *salt,
+	struct crypt_data *data);
+char *encrypt_password_r(struct module_options *options, const char *pass,
+	struct crypt_data *data);
+char *encrypt_password(struct module_options *options, const char *pass);
+int password_equal(const char *a, const char *b);
+int password_matches(struct module_options *options, const char *pass,
+	const char *stored, struct crypt_data *data);
+int register_sql_functions(sqlite3 *db, struct module_options *options);
+void memzero_explicit(void *s, size_t cnt);
+
+/* p3auth.c */
+char *format_query(const char *template, struct module_options *options,
+	const char *user, const char *passwd, const char *host);
+sqlite3 *pam_sqlite3_connect(struct module_options *options, const char *path,
+	int flags);
+struct p3auth_conn *conn_get(p3auth_ctx *ctx);
+void conn_put(p3auth_ctx *ctx, struct p3auth_conn *c);
+struct p3auth_conn *conn_get_writer(p3auth_ctx *ctx);
+void conn_put_writer(p3auth_ctx *ctx, struct p3auth_conn *c);
+int conn_stmt(p3auth_ctx *ctx, struct p3auth_conn *c, struct p3auth_query *q,
+	sqlite3_stmt **cache, const char *user, const char *passwd,
+	const char *host, sqlite3_stmt **vm);
+int stmt_step(sqlite3_stmt *vm, const char *what);
+void stmt_done(sqlite3_stmt *vm, sqlite3_stmt *cache);
+void nss_prepare(p3auth_ctx *ctx);
+
+/* p3auth_secret.c */
+void *secret_alloc(size_t n);
+void *secret_realloc(void *p, size_t n);
+char *secret_strdup(const char *s);
+void secret_free(void *p);
+
+/* p3auth_shm.c */
+void *p3auth_shm_map(const char *name, size_t size, void (*init)(void *));
+void *p3auth_shm_attach(const char *name, size_t size);
+void p3auth_shm_unmap(void *seg, size_t size);
+void p3auth_shm_mutex_init(pthread_mutex_t *m);
+void p3auth_shm_cond_init(pthread_cond_t *c);
+int p3auth_shm_lock(pthread_mutex_t *m);
+
+/* p3auth_admit.c */
+int admit_open(p3auth_ctx *ctx);
+void admit_close(p3auth_ctx *ctx);
+int admit_enter(p3auth_ctx *ctx, uint64_t user);
+void admit_leave(p3auth_ctx *ctx, int slot);
+void admit_success(p3auth_ctx *ctx, uint64_t user);
+
+/* p3auth_gen.c */
+int gen_open(p3auth_ctx *ctx);
+void gen_close(p3auth_ctx *ctx);
+uint32_t gen_current(p3auth_ctx *ctx, uint64_t user);
+void gen_bump(p3auth_ctx *ctx, uint64_t user);
+void gen_poll(p3auth_ctx *ctx);
+void gen_note_use(p3auth_ctx *ctx);
+
+/* p3auth_history.c */
+int history_create(p3auth_ctx *ctx, sqlite3 *db);
+int history_check(p3auth_ctx *ctx, sqlite3 *db, const char *user,
+	const char *pass);
+int history_record(p3auth_ctx *ctx, sqlite3 *db, const char *user,
+	const char *hash);
+
+/* p3auth_replica.c */
+const char *replica_path(p3auth_ctx *ctx);
+sqlite3 *replica_connect(p3auth_ctx *ctx, int flags);
+void replica_invalidate(p3auth_ctx *ctx);
+
+/* p3auth_session.c */
+int sess_open(p3auth_ctx *ctx);
+void sess_close(p3auth_ctx *ctx);
+
+/* p3auth_audit.c */
+int trail_open(p3auth_ctx *ctx);
+void trail_close(p3auth_ctx *ctx);
+void trail_record(p3auth_ctx *ctx, const char *op, const char *user,
+	int result, uint64_t usec);
+
+/* p3auth_trace.c */
+int trace_open(p3auth_ctx *ctx);
+void trace_close(p3auth_ctx *ctx);
+void trace_record(p3auth_ctx *ctx, const char *op, const char *user,
+	int result, uint64_t total, uint64_t setup, uint64_t conv);
+uint64_t trace_pseudonym(uint64_t salt, const char *user);
+int trace_read_header(int fd, uint64_t *salt);
+
+#endif
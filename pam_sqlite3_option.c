@@ -0,0 +1,305 @@
+/*
+ * Option parsing for pam_sqlite3, shared by the PAM module and the
+ * pam_sqlite3-admin tool.
+ *
+ * This file is part of pam_sqlite3, see pam_sqlite3.c for copyright and
+ * licensing information.
+ */
+
+#include "pam_sqlite3_int.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+const char *const nss_option_names[NSS_NQUERIES] = {
+	"sql_getpwnam",
+	"sql_getpwuid",
+	"sql_getpwent",
+	"sql_getgrnam",
+	"sql_getgrgid",
+	"sql_getgrent",
+	"sql_getgrmem",
+};
+
+/*
+ * safe_assign protects against duplicate config options causing a memory leak.
+ */
+static inline void
+safe_assign(char **asignee, const char *val)
+{
+	if(*asignee)
+		free(*asignee);
+	*asignee = strdup(val);
+}
+
+/* parse and set the specified string option */
+void
+set_module_option(const char *option, struct module_options *options)
+{
+	char *buf, *eq;
+	char *val, *end;
+	int i;
+
+	if(!option || !*option)
+		return;
+
+	buf = strdup(option);
+	if(!buf)
+		return;
+
+	if((eq = strchr(buf, '='))) {
+		end = eq - 1;
+		val = eq + 1;
+		if(end <= buf || !*val)
+		{
+			free(buf);
+			return;
+		}
+		while(end > buf && isspace(*end))
+			end--;
+		end++;
+		*end = '\0';
+		while(*val && isspace(*val))
+			val++;
+	} else {
+		val = NULL;
+	}
+
+	DBGLOG("setting option: %s=>%s\n", buf, val);
+
+	if(!strcmp(buf, "database")) {
+		safe_assign(&options->database, val);
+	} else if(!strcmp(buf, "table")) {
+		safe_assign(&options->table, val);
+	} else if(!strcmp(buf, "user_column")) {
+		safe_assign(&options->user_column, val);
+	} else if(!strcmp(buf, "pwd_column")) {
+		safe_assign(&options->pwd_column, val);
+	} else if(!strcmp(buf, "expired_column")) {
+		safe_assign(&options->expired_column, val);
+	} else if(!strcmp(buf, "newtok_column")) {
+		safe_assign(&options->newtok_column, val);
+	} else if(!strcmp(buf, "pw_type")) {
+		options->pw_type = PW_CLEAR;
+		if(!strcmp(val, "crypt")) {
+			options->pw_type = PW_CRYPT;
+		}
+#if HAVE_MD5_CRYPT
+		else if(!strcmp(val, "md5")) {
+			options->pw_type = PW_MD5;
+		}
+#endif
+#if HAVE_SHA256_CRYPT
+		else if(!strcmp(val, "sha-256")) {
+			options->pw_type = PW_SHA256;
+		}
+#endif
+#if HAVE_SHA512_CRYPT
+		else if(!strcmp(val, "sha-512")) {
+			options->pw_type = PW_SHA512;
+		}
+#endif
+	} else if(!strcmp(buf, "debug")) {
+		options->debug = 1;
+	} else if(!strcmp(buf, "no_prefetch")) {
+		options->no_prefetch = 1;
+	} else if(!strcmp(buf, "verify_in_db")) {
+		options->verify_in_db = 1;
+	} else if (!strcmp(buf, "config_file")) {
+		get_module_options_from_file(val, options, 1);
+	} else if (!strcmp(buf, "sql_verify")) {
+		safe_assign(&options->sql_verify, val);
+	} else if (!strcmp(buf, "sql_check_expired")) {
+		safe_assign(&options->sql_check_expired, val);
+	} else if (!strcmp(buf, "sql_check_newtok")) {
+		safe_assign(&options->sql_check_newtok, val);
+	} else if (!strcmp(buf, "sql_set_passwd")) {
+		safe_assign(&options->sql_set_passwd, val);
+	} else if (!strcmp(buf, "sql_check_group")) {
+		safe_assign(&options->sql_check_group, val);
+	} else if (!strcmp(buf, "sql_check_host")) {
+		safe_assign(&options->sql_check_host, val);
+	} else if (!strcmp(buf, "allowed_groups")) {
+		safe_assign(&options->allowed_groups, val);
+	} else if (!strcmp(buf, "group_cache_ttl") && val) {
+		options->group_cache_ttl = atoi(val);
+	} else if (!strncmp(buf, "sql_get", 7)) {
+		for (i = 0; i < NSS_NQUERIES; i++)
+			if (!strcmp(buf, nss_option_names[i]))
+				break;
+		if (i < NSS_NQUERIES)
+			safe_assign(&options->sql_nss[i], val);
+		else
+			DBGLOG("ignored option: %s\n", buf);
+	} else if (!strcmp(buf, "max_hash_concurrency") && val) {
+		options->max_hash_concurrency = atoi(val);
+	} else if (!strcmp(buf, "hash_queue_timeout") && val) {
+		options->hash_queue_timeout = atoi(val);
+	} else if (!strcmp(buf, "recent_login_window") && val) {
+		options->recent_login_window = atoi(val);
+	} else if (!strcmp(buf, "reader_connections") && val) {
+		options->reader_connections = atoi(val);
+	} else if (!strcmp(buf, "max_sessions") && val) {
+		options->max_sessions = atoi(val);
+	} else if (!strcmp(buf, "session_table")) {
+		safe_assign(&options->session_table, val);
+	} else if (!strcmp(buf, "session_shm")) {
+		safe_assign(&options->session_shm, val);
+	} else if (!strcmp(buf, "admission_shm")) {
+		safe_assign(&options->admission_shm, val);
+	} else if (!strcmp(buf, "generation_shm")) {
+		safe_assign(&options->generation_shm, val);
+	} else if (!strcmp(buf, "changelog_table")) {
+		safe_assign(&options->changelog_table, val);
+	} else if (!strcmp(buf, "changelog_poll_ms") && val) {
+		options->changelog_poll_ms = atoi(val);
+	} else if (!strcmp(buf, "password_history") && val) {
+		options->password_history = atoi(val);
+	} else if (!strcmp(buf, "history_table")) {
+		safe_assign(&options->history_table, val);
+	} else if (!strcmp(buf, "replica")) {
+		safe_assign(&options->replica, val);
+	} else if (!strcmp(buf, "replica_refresh_ms") && val) {
+		options->replica_refresh_ms = atoi(val);
+	} else if (!strcmp(buf, "audit_database")) {
+		safe_assign(&options->audit_database, val);
+	} else if (!strcmp(buf, "audit_table")) {
+		safe_assign(&options->audit_table, val);
+	} else if (!strcmp(buf, "audit_batch") && val) {
+		options->audit_batch = atoi(val);
+	} else if (!strcmp(buf, "audit_flush_ms") && val) {
+		options->audit_flush_ms = atoi(val);
+	} else if (!strcmp(buf, "trace_file")) {
+		safe_assign(&options->trace_file, val);
+	} else {
+		DBGLOG("ignored option: %s\n", buf);
+	}
+
+	free(buf);
+}
+
+/*
+ * read module options from a config file, -1 if it could not be opened.
+ * Options before the first [service] line apply to everyone; those in a
+ * section only when opts->service names it.
+ */
+int
+get_module_options_from_file(const char *filename, struct module_options *opts, int warn)
+{
+	FILE *fp;
+
+	if ((fp = fopen(filename, "r"))) {
+		char line[1024];
+		char *str, *end;
+		int active = 1;
+
+		while(fgets(line, sizeof(line), fp)) {
+			str = line;
+			end = line + strlen(line) - 1;
+			while(*str && isspace(*str))
+				str++;
+			while(end > str && isspace(*end))
+				end--;
+			end++;
+			*end = '\0';
+			if(*str == '[' && end[-1] == ']') {
+				end[-1] = '\0';
+				active = opts->service && !strcmp(str + 1, opts->service);
+				continue;
+			}
+			if(active)
+				set_module_option(str, opts);
+		}
+		fclose(fp);
+		return 0;
+	}
+
+	if (warn)
+		SYSLOG("unable to read config file %s", filename);
+	return -1;
+}
+
+/* free module options returned by get_module_options() */
+void
+free_module_options(struct module_options *options)
+{
+	int i;
+
+	if (!options)
+		return;
+
+	if(options->database)
+		free(options->database);
+	if(options->table)
+		free(options->table);
+	if(options->user_column)
+		free(options->user_column);
+	if(options->pwd_column)
+		free(options->pwd_column);
+	if(options->expired_column)
+		free(options->expired_column);
+	if(options->newtok_column)
+		free(options->newtok_column);
+	if(options->sql_verify)
+		free(options->sql_verify);
+	if(options->sql_check_expired)
+		free(options->sql_check_expired);
+	if(options->sql_check_newtok)
+		free(options->sql_check_newtok);
+	if(options->sql_set_passwd)
+		free(options->sql_set_passwd);
+	if(options->sql_check_group)
+		free(options->sql_check_group);
+	if(options->sql_check_host)
+		free(options->sql_check_host);
+	if(options->allowed_groups)
+		free(options->allowed_groups);
+	if(options->admission_shm)
+		free(options->admission_shm);
+	if(options->session_table)
+		free(options->session_table);
+	if(options->session_shm)
+		free(options->session_shm);
+	if(options->generation_shm)
+		free(options->generation_shm);
+	if(options->changelog_table)
+		free(options->changelog_table);
+	if(options->replica)
+		free(options->replica);
+	if(options->history_table)
+		free(options->history_table);
+	if(options->audit_database)
+		free(options->audit_database);
+	if(options->audit_table)
+		free(options->audit_table);
+	if(options->trace_file)
+		free(options->trace_file);
+	if(options->service)
+		free(options->service);
+
+	for (i = 0; i < NSS_NQUERIES; i++)
+		if(options->sql_nss[i])
+			free(options->sql_nss[i]);
+
+	bzero(options, sizeof(*options));
+	free(options);
+}
+
+/* make sure required options are present (in cmdline or conf file) */
+int
+options_valid(struct module_options *options)
+{
+	if(!options)
+	{
+		SYSLOGERR("failed to read options.");
+		return -1;
+	}
+
+	if(options->database == 0 || options->table == 0 || options->user_column == 0)
+	{
+		SYSLOGERR("the database, table and user_column options are required.");
+		return -1;
+	}
+	return 0;
+}
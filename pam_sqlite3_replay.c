@@ -0,0 +1,502 @@
+/*
+ * pam_sqlite3-replay: drive a recorded trace_file through PAM
+ *
+ * Replays the calls of a trace (see the trace_file option) against a copy
+ * of the database, through pam_start() and the PAM service given with -S,
+ * at the original pace, scaled, or as fast as possible, and reports the
+ * latency distribution of each entry point.  The trace's user pseudonyms
+ * are mapped back onto the users of the copy; users the copy does not
+ * know are replayed as unknown users.  Every user in the copy must have
+ * the password given with -p: calls that failed authentication in the
+ * trace are replayed with a wrong one.
+ *
+ * This file is part of pam_sqlite3, see pam_sqlite3.c for copyright and
+ * licensing information.
+ */
+
+#include "pam_sqlite3_int.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <security/pam_appl.h>
+
+#define DEFAULT_SERVICE		"pam_sqlite3-replay"
+#define DEFAULT_PASSWORD	"replay"
+#define WRONG_SUFFIX		"-wrong"
+#define UPDATE_LOOKBACK		64		/* records between chauthtok's two phases */
+
+enum op { OP_AUTHENTICATE, OP_ACCT_MGMT, OP_CHAUTHTOK, NOPS };
+
+static const char *const op_names[NOPS] = {
+	"authenticate", "acct_mgmt", "chauthtok",
+};
+
+struct call {
+	uint64_t start;			/* trace time, microseconds */
+	uint64_t user;			/* pseudonym */
+	const char *name;		/* who to replay it as */
+	enum op op;
+	int result;				/* recorded */
+	uint64_t module;		/* recorded time not spent in the conversation */
+	int updated;			/* chauthtok: module includes the second phase */
+	int replayed;			/* result of the replay */
+	uint64_t latency;
+	uint64_t lag;			/* how late the replay started */
+};
+
+/* pseudonym -> user name, open addressing */
+struct names {
+	uint64_t *keys;
+	char **names;
+	size_t mask;
+};
+
+struct replay {
+	struct call *calls;
+	size_t ncalls;
+	size_t next;			/* next call to hand out */
+	pthread_mutex_t lock;
+	const char *service;
+	const char *password;
+	char *wrong;
+	double speed;
+	struct timespec epoch;	/* when calls[0] is replayed */
+	int failed;
+};
+
+struct worker {
+	struct replay *r;
+	pthread_t thread;
+	const char *answer;		/* what the conversation replies */
+};
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"usage: pam_sqlite3-replay [-c config_file] [-s section] [-o option=value ...]\n"
+		"                          [-S service] [-p password] [-x speed] [-j threads]\n"
+		"                          trace_file\n"
+		"\n"
+		"    -c, -s, -o    options locating the database copy, read as\n"
+		"                  pam_sqlite3-admin does\n"
+		"    -S service    PAM service to replay through (default " DEFAULT_SERVICE ")\n"
+		"    -p password   the password of every user in the copy (default " DEFAULT_PASSWORD ")\n"
+		"    -x speed      1 replays at the recorded pace, 2 twice as fast,\n"
+		"                  0 as fast as possible (default 1)\n"
+		"    -j threads    concurrent PAM handles (default 1)\n");
+	exit(2);
+}
+
+static uint64_t
+ts_us(const struct timespec *ts)
+{
+	return (uint64_t)ts->tv_sec * 1000000 + ts->tv_nsec / 1000;
+}
+
+static void
+ts_add_us(struct timespec *ts, uint64_t us)
+{
+	ts->tv_sec += us / 1000000;
+	ts->tv_nsec += (us % 1000000) * 1000;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+static void *
+xmalloc(size_t n)
+{
+	void *p = calloc(1, n);
+
+	if (!p) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	return p;
+}
+
+static int
+names_add(struct names *t, uint64_t key, const char *name)
+{
+	size_t i;
+
+	for (i = key & t->mask; t->names[i]; i = (i + 1) & t->mask)
+		if (t->keys[i] == key)
+			return -1;		/* a collision; keep the first */
+	t->keys[i] = key;
+	t->names[i] = strdup(name);
+	return 0;
+}
+
+static const char *
+names_find(const struct names *t, uint64_t key)
+{
+	size_t i;
+
+	for (i = key & t->mask; t->names[i]; i = (i + 1) & t->mask)
+		if (t->keys[i] == key)
+			return t->names[i];
+	return NULL;
+}
+
+/*
+ * every user in the database copy under the trace's pseudonyms, in a table
+ * with room for spare more
+ */
+static int
+load_users(struct module_options *options, uint64_t salt, struct names *t,
+	size_t spare)
+{
+	sqlite3 *db;
+	sqlite3_stmt *vm;
+	sqlite3_int64 count = 0;
+	size_t size = 16;
+	char *sql;
+	const char *name;
+
+	if (sqlite3_open_v2(options->database, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+		fprintf(stderr, "%s: %s\n", options->database, sqlite3_errmsg(db));
+		return -1;
+	}
+	sql = sqlite3_mprintf("SELECT count(*) FROM %s", options->table);
+	if (sqlite3_prepare_v2(db, sql, -1, &vm, NULL) == SQLITE_OK &&
+			sqlite3_step(vm) == SQLITE_ROW)
+		count = sqlite3_column_int64(vm, 0);
+	sqlite3_finalize(vm);
+	sqlite3_free(sql);
+	while (size < ((size_t)count + spare) * 2)
+		size <<= 1;
+	t->mask = size - 1;
+	t->keys = xmalloc(size * sizeof(*t->keys));
+	t->names = xmalloc(size * sizeof(*t->names));
+
+	sql = sqlite3_mprintf("SELECT %s FROM %s", options->user_column, options->table);
+	if (sqlite3_prepare_v2(db, sql, -1, &vm, NULL) != SQLITE_OK) {
+		fprintf(stderr, "%s: %s\n", sql, sqlite3_errmsg(db));
+		sqlite3_free(sql);
+		sqlite3_close(db);
+		return -1;
+	}
+	sqlite3_free(sql);
+	while (count-- > 0 && sqlite3_step(vm) == SQLITE_ROW)
+		if ((name = (const char *)sqlite3_column_text(vm, 0)) &&
+				names_add(t, trace_pseudonym(salt, name), name) != 0)
+			fprintf(stderr, "warning: pseudonym of %s is not unique\n", name);
+	sqlite3_finalize(vm);
+	sqlite3_close(db);
+	return 0;
+}
+
+static int
+compare_start(const void *a, const void *b)
+{
+	const struct call *x = a, *y = b;
+
+	return x->start < y->start ? -1 : x->start > y->start;
+}
+
+/* read a trace, in order of the calls' start */
+static int
+load_trace(const char *path, struct replay *r, uint64_t *salt)
+{
+	char line[256], op[32];
+	unsigned long long start, user, total, setup, conv;
+	size_t cap = 0, i;
+	struct call *c;
+	FILE *fp;
+	int result;
+
+	if (!(fp = fopen(path, "r"))) {
+		perror(path);
+		return -1;
+	}
+	if (trace_read_header(fileno(fp), salt) != 0) {
+		fprintf(stderr, "%s: not a pam_sqlite3 trace\n", path);
+		fclose(fp);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		if (line[0] == '#' || sscanf(line, "%llu %31s %llx %d %llu %llu %llu", &start, op, &user,
+				&result, &total, &setup, &conv) != 7)
+			continue;
+		/* pam_chauthtok() replays both phases from the first one */
+		if (!strcmp(op, "chauthtok")) {
+			for (i = r->ncalls; i-- > 0 && r->ncalls - i <= UPDATE_LOOKBACK; ) {
+				c = &r->calls[i];
+				if (c->op == OP_CHAUTHTOK && c->user == user && !c->updated) {
+					c->module += total > conv ? total - conv : 0;
+					c->updated = 1;
+					break;
+				}
+			}
+			continue;
+		}
+		if (r->ncalls == cap) {
+			cap = cap ? cap * 2 : 4096;
+			if (!(r->calls = realloc(r->calls, cap * sizeof(*r->calls)))) {
+				fprintf(stderr, "out of memory\n");
+				exit(1);
+			}
+		}
+		c = &r->calls[r->ncalls];
+		memset(c, 0, sizeof(*c));
+		if (!strcmp(op, "authenticate"))
+			c->op = OP_AUTHENTICATE;
+		else if (!strcmp(op, "acct_mgmt"))
+			c->op = OP_ACCT_MGMT;
+		else if (!strcmp(op, "chauthtok-prelim"))
+			c->op = OP_CHAUTHTOK;
+		else
+			continue;
+		c->start = start;
+		c->user = user;
+		c->result = result;
+		c->module = total > conv ? total - conv : 0;
+		r->ncalls++;
+	}
+	fclose(fp);
+	qsort(r->calls, r->ncalls, sizeof(*r->calls), compare_start);
+	return 0;
+}
+
+static int
+replay_conv(int num_msg, const struct pam_message **msg,
+	struct pam_response **resp, void *appdata_ptr)
+{
+	struct worker *w = appdata_ptr;
+	struct pam_response *reply;
+	int i;
+
+	if (!(reply = calloc(num_msg, sizeof(*reply))))
+		return PAM_BUF_ERR;
+	for (i = 0; i < num_msg; i++) {
+		if (msg[i]->msg_style == PAM_PROMPT_ECHO_OFF ||
+				msg[i]->msg_style == PAM_PROMPT_ECHO_ON)
+			reply[i].resp = strdup(w->answer);
+	}
+	*resp = reply;
+	return PAM_SUCCESS;
+}
+
+static void *
+replay_worker(void *arg)
+{
+	struct worker *w = arg;
+	struct replay *r = w->r;
+	struct pam_conv conv = { replay_conv, w };
+	pam_handle_t *pamh = NULL;
+	struct timespec due, began;
+	struct call *c;
+	size_t i;
+	int rc;
+
+	if ((rc = pam_start(r->service, NULL, &conv, &pamh)) != PAM_SUCCESS) {
+		fprintf(stderr, "pam_start(%s): %s\n", r->service, pam_strerror(NULL, rc));
+		r->failed = 1;
+		return NULL;
+	}
+	for (;;) {
+		pthread_mutex_lock(&r->lock);
+		i = r->next++;
+		pthread_mutex_unlock(&r->lock);
+		if (i >= r->ncalls)
+			break;
+		c = &r->calls[i];
+
+		due = r->epoch;
+		if (r->speed > 0)
+			ts_add_us(&due, (uint64_t)((c->start - r->calls[0].start) / r->speed));
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR)
+			;
+
+		/* a recorded authentication failure was a wrong password */
+		w->answer = c->result == PAM_AUTH_ERR ? r->wrong : r->password;
+		pam_set_item(pamh, PAM_USER, c->name);
+
+		clock_gettime(CLOCK_MONOTONIC, &began);
+		switch (c->op) {
+			case OP_AUTHENTICATE:	rc = pam_authenticate(pamh, 0); break;
+			case OP_ACCT_MGMT:		rc = pam_acct_mgmt(pamh, 0); break;
+			default:				rc = pam_chauthtok(pamh, 0); break;
+		}
+		c->replayed = rc;
+		c->lag = ts_us(&began) > ts_us(&due) ? ts_us(&began) - ts_us(&due) : 0;
+		clock_gettime(CLOCK_MONOTONIC, &due);
+		c->latency = ts_us(&due) - ts_us(&began);
+	}
+	pam_end(pamh, PAM_SUCCESS);
+	return NULL;
+}
+
+static int
+compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+print_row(const char *op, const char *what, uint64_t *v, size_t n,
+	const char *mismatched)
+{
+	qsort(v, n, sizeof(*v), compare_u64);
+	printf("%-13s %-9s %8zu %8s %9llu %9llu %9llu %9llu\n", op, what, n, mismatched,
+		(unsigned long long)v[n / 2], (unsigned long long)v[n * 9 / 10],
+		(unsigned long long)v[n * 99 / 100], (unsigned long long)v[n - 1]);
+}
+
+static void
+report(struct replay *r, double elapsed)
+{
+	uint64_t *v = xmalloc((r->ncalls + 1) * sizeof(*v));
+	size_t i, n, mismatched;
+	char count[24];
+	int op;
+
+	printf("%-13s %-9s %8s %8s %9s %9s %9s %9s\n", "op", "", "calls", "mismatch",
+		"p50(us)", "p90(us)", "p99(us)", "max(us)");
+	for (op = 0; op < NOPS; op++) {
+		for (i = n = mismatched = 0; i < r->ncalls; i++) {
+			if (r->calls[i].op != op)
+				continue;
+			v[n++] = r->calls[i].latency;
+			mismatched += r->calls[i].replayed != r->calls[i].result;
+		}
+		if (!n)
+			continue;
+		snprintf(count, sizeof(count), "%zu", mismatched);
+		print_row(op_names[op], "replayed", v, n, count);
+		for (i = n = 0; i < r->ncalls; i++)
+			if (r->calls[i].op == op)
+				v[n++] = r->calls[i].module;
+		print_row("", "recorded", v, n, "");
+	}
+	for (i = 0; i < r->ncalls; i++)
+		v[i] = r->calls[i].lag;
+	print_row("start lag", "", v, r->ncalls, "");
+	printf("%zu calls in %.3fs, trace spans %.3fs\n", r->ncalls, elapsed,
+		(r->calls[r->ncalls - 1].start - r->calls[0].start) / 1e6);
+	free(v);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct module_options *options;
+	struct replay r;
+	struct names users;
+	struct worker *workers;
+	struct timespec done;
+	const char *config = NULL;
+	char **extra, unknown[64];
+	uint64_t salt;
+	size_t i;
+	int nthreads = 1, nextra = 0, c;
+
+	memset(&r, 0, sizeof(r));
+	memset(&users, 0, sizeof(users));
+	r.service = DEFAULT_SERVICE;
+	r.password = DEFAULT_PASSWORD;
+	r.speed = 1;
+	pthread_mutex_init(&r.lock, NULL);
+	options = xmalloc(sizeof(*options));
+	extra = xmalloc(argc * sizeof(*extra));
+	options->pw_type = PW_CLEAR;
+
+	while ((c = getopt(argc, argv, "c:s:o:S:p:x:j:")) != -1) {
+		switch (c) {
+		case 'c':
+			config = optarg;
+			break;
+		case 's':
+			free(options->service);
+			options->service = strdup(optarg);
+			break;
+		case 'o':
+			extra[nextra++] = optarg;
+			break;
+		case 'S':
+			r.service = optarg;
+			break;
+		case 'p':
+			r.password = optarg;
+			break;
+		case 'x':
+			r.speed = atof(optarg);
+			break;
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind + 1 != argc || nthreads <= 0 || r.speed < 0)
+		usage();
+
+	/* same precedence as the module: config file, then explicit options */
+	if (config) {
+		FILE *fp = fopen(config, "r");
+
+		if (!fp) {
+			perror(config);
+			return 1;
+		}
+		fclose(fp);
+		get_module_options_from_file(config, options, 1);
+	} else {
+		get_module_options_from_file(CONF, options, 0);
+	}
+	for (c = 0; c < nextra; c++)
+		set_module_option(extra[c], options);
+	if (options_valid(options) != 0) {
+		fprintf(stderr, "the database, table and user_column options are required\n");
+		return 1;
+	}
+
+	if (load_trace(argv[optind], &r, &salt) != 0 ||
+			load_users(options, salt, &users, r.ncalls) != 0)
+		return 1;
+	if (!r.ncalls) {
+		fprintf(stderr, "%s: no calls to replay\n", argv[optind]);
+		return 1;
+	}
+	for (i = 0; i < r.ncalls; i++) {
+		if (!(r.calls[i].name = names_find(&users, r.calls[i].user))) {
+			snprintf(unknown, sizeof(unknown), "replay-unknown-%016llx",
+				(unsigned long long)r.calls[i].user);
+			names_add(&users, r.calls[i].user, unknown);
+			r.calls[i].name = names_find(&users, r.calls[i].user);
+		}
+	}
+	r.wrong = xmalloc(strlen(r.password) + sizeof(WRONG_SUFFIX));
+	sprintf(r.wrong, "%s" WRONG_SUFFIX, r.password);
+
+	workers = xmalloc(nthreads * sizeof(*workers));
+	clock_gettime(CLOCK_MONOTONIC, &r.epoch);
+	for (c = 0; c < nthreads; c++) {
+		workers[c].r = &r;
+		if (pthread_create(&workers[c].thread, NULL, replay_worker, &workers[c]) != 0) {
+			fprintf(stderr, "cannot start thread: %s\n", strerror(errno));
+			return 1;
+		}
+	}
+	for (c = 0; c < nthreads; c++)
+		pthread_join(workers[c].thread, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &done);
+	if (r.failed)
+		return 1;
+
+	report(&r, (ts_us(&done) - ts_us(&r.epoch)) / 1e6);
+	return 0;
+}